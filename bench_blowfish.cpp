@@ -0,0 +1,183 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+// Known-answer tests and throughput of the multi-block Blowfish functions.
+// Usage: bench_blowfish [seconds per measure]
+extern "C" {
+#include "blowfish.h"
+}
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Eric Young's test vectors: key, plaintext, ciphertext
+static const uint64_t Vectors[][3] = {
+	{ 0x0000000000000000, 0x0000000000000000, 0x4EF997456198DD78 },
+	{ 0xFFFFFFFFFFFFFFFF, 0xFFFFFFFFFFFFFFFF, 0x51866FD5B85ECB8A },
+	{ 0x3000000000000000, 0x1000000000000001, 0x7D856F9A613063F2 },
+	{ 0x1111111111111111, 0x1111111111111111, 0x2466DD878B963C9D },
+	{ 0x0123456789ABCDEF, 0x1111111111111111, 0x61F9C3802281B096 },
+	{ 0x1111111111111111, 0x0123456789ABCDEF, 0x7D0CC630AFDA1EC7 },
+	{ 0xFEDCBA9876543210, 0x0123456789ABCDEF, 0x0ACEAB0FC6A0A28D },
+	{ 0x7CA110454A1A6E57, 0x01A1D6D039776742, 0x59C68245EB05282B },
+	{ 0x0131D9619DC1376E, 0x5CD54CA83DEF57DA, 0xB1B8CC0B250F09A0 },
+	{ 0x07A1133E4A0B2686, 0x0248D43806F67172, 0x1730E5778BEA1DA4 },
+	{ 0x3849674C2602319E, 0x51454B582DDF440A, 0xA25E7856CF2651EB },
+	{ 0x04B915BA43FEB5B6, 0x42FD443059577FA2, 0x353882B109CE8F1A },
+	{ 0x0113B970FD34F2CE, 0x059B5E0851CF143A, 0x48F4D0884C379918 },
+	{ 0x0170F175468FB5E6, 0x0756D8E0774761D2, 0x432193B78951FC98 },
+	{ 0x43297FAD38E373FE, 0x762514B829BF486A, 0x13F04154D69D1AE5 },
+	{ 0x07A7137045DA2A16, 0x3BDD119049372802, 0x2EEDDA93FFD39C79 },
+	{ 0x04689104C2FD3B2F, 0x26955F6835AF609A, 0xD887E0393C2DA6E3 },
+	{ 0x37D06BB516CB7546, 0x164D5E404F275232, 0x5F99D04F5B163969 },
+	{ 0x1F08260D1AC2465E, 0x6B056E18759F5CCA, 0x4A057A3B24D3977B },
+	{ 0x584023641ABA6176, 0x004BD6EF09176062, 0x452031C1E4FADA8E },
+	{ 0x025816164629B007, 0x480D39006EE762F2, 0x7555AE39F59B87BD },
+	{ 0x49793EBC79B3258F, 0x437540C8698F3CFA, 0x53C55F9CB49FC019 },
+	{ 0x4FB05E1515AB73A7, 0x072D43A077075292, 0x7A8E7BFA937E89A3 },
+	{ 0x49E95D6D4CA229BF, 0x02FE55778117F12A, 0xCF9C5D7A4986ADB5 },
+	{ 0x018310DC409B26D6, 0x1D9D5C5018F728C2, 0xD1ABB290658BC778 },
+	{ 0x1C587F1C13924FEF, 0x305532286D6F295A, 0x55CB3774D13EF201 },
+	{ 0x0101010101010101, 0x0123456789ABCDEF, 0xFA34EC4847B268B2 },
+	{ 0x1F1F1F1F0E0E0E0E, 0x0123456789ABCDEF, 0xA790795108EA3CAE },
+	{ 0xE0FEE0FEF1FEF1FE, 0x0123456789ABCDEF, 0xC39E072D9FAC631D },
+	{ 0x0000000000000000, 0xFFFFFFFFFFFFFFFF, 0x014933E0CDAFF6E4 },
+	{ 0xFFFFFFFFFFFFFFFF, 0x0000000000000000, 0xF21E9A77B71C49BC },
+	{ 0x0123456789ABCDEF, 0x0000000000000000, 0x245946885754369A },
+	{ 0xFEDCBA9876543210, 0xFFFFFFFFFFFFFFFF, 0x6B5C5A9C5D9E0A5A },
+};
+
+static void store64(uint8_t *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (uint8_t)(v >> (56 - i * 8));
+}
+
+// Each vector is checked with the single-block functions, then repeated in buffers of all the sizes up to
+// 4 interleaved iterations plus a tail, so that every lane and the tail of the multi-block functions are covered.
+static int knownAnswerTests()
+{
+	constexpr size_t MaxBlocks = 19;
+	int failures = 0;
+	for (const auto& v : Vectors)
+	{
+		uint8_t key[8];
+		store64(key, v[0]);
+		BLOWFISH_CTX ctx;
+		Blowfish_Init(&ctx, key, sizeof(key));
+
+		uint32_t l = (uint32_t)(v[1] >> 32);
+		uint32_t r = (uint32_t)v[1];
+		Blowfish_Encrypt(&ctx, &l, &r);
+		if ((((uint64_t)l << 32) | r) != v[2]) {
+			fprintf(stderr, "KAT failed: key %016lX encrypt\n", (unsigned long)v[0]);
+			failures++;
+		}
+		Blowfish_Decrypt(&ctx, &l, &r);
+		if ((((uint64_t)l << 32) | r) != v[1]) {
+			fprintf(stderr, "KAT failed: key %016lX decrypt\n", (unsigned long)v[0]);
+			failures++;
+		}
+
+		for (size_t blocks = 1; blocks <= MaxBlocks; blocks++)
+		{
+			uint8_t buf[MaxBlocks * 8];
+			for (size_t i = 0; i < blocks; i++)
+				store64(&buf[i * 8], v[1]);
+			Blowfish_EncryptECB(&ctx, buf, blocks * 8);
+			uint8_t expected[8];
+			store64(expected, v[2]);
+			for (size_t i = 0; i < blocks; i++)
+				if (memcmp(&buf[i * 8], expected, 8)) {
+					fprintf(stderr, "KAT failed: key %016lX ECB encrypt block %zd/%zd\n", (unsigned long)v[0], i, blocks);
+					failures++;
+				}
+			Blowfish_DecryptECB(&ctx, buf, blocks * 8);
+			store64(expected, v[1]);
+			for (size_t i = 0; i < blocks; i++)
+				if (memcmp(&buf[i * 8], expected, 8)) {
+					fprintf(stderr, "KAT failed: key %016lX ECB decrypt block %zd/%zd\n", (unsigned long)v[0], i, blocks);
+					failures++;
+				}
+		}
+	}
+	return failures;
+}
+
+template<typename F>
+static double blocksPerSecond(size_t len, double seconds, F f)
+{
+	uint64_t blocks = 0;
+	const Clock::time_point start = Clock::now();
+	Clock::duration elapsed;
+	do {
+		for (int i = 0; i < 1000; i++)
+			f();
+		blocks += 1000 * (len / 8);
+		elapsed = Clock::now() - start;
+	} while (elapsed < std::chrono::duration<double>(seconds));
+	return blocks / std::chrono::duration<double>(elapsed).count();
+}
+
+// The auth messages are up to 0x90 bytes
+static const size_t Sizes[] = { 0x90, 4096 };
+
+static void benchmark(const BLOWFISH_CTX& ctx, const char *name, double seconds, bool reference)
+{
+	for (size_t len : Sizes)
+	{
+		std::vector<uint8_t> buf(len, 0x5a);
+		double rate;
+		if (reference)
+		{
+			// One block at a time, as before the multi-block functions
+			BLOWFISH_CTX c = ctx;
+			rate = blocksPerSecond(len, seconds, [&]() {
+				for (size_t i = 0; i < len; i += 8)
+				{
+					uint32_t *p = (uint32_t *)&buf[i];
+					Blowfish_Encrypt(&c, &p[0], &p[1]);
+				}
+			});
+		}
+		else
+		{
+			rate = blocksPerSecond(len, seconds, [&]() {
+				Blowfish_EncryptECB(&ctx, buf.data(), len);
+			});
+		}
+		printf("%-10s %5zd bytes: %7.2f M blocks/s\n", name, len, rate / 1e6);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const double seconds = argc >= 2 ? atof(argv[1]) : 1.0;
+	BLOWFISH_CTX ctx;
+	Blowfish_Init(&ctx, (uint8_t *)"ArelleporP", 10);
+
+	const int failures = knownAnswerTests();
+	printf("KAT: %s\n", failures == 0 ? "passed" : "FAILED");
+	benchmark(ctx, "ecb", seconds, false);
+	benchmark(ctx, "reference", seconds, true);
+
+	return failures == 0 ? 0 : 1;
+}
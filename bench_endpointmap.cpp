@@ -0,0 +1,130 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+// Compares the player lookup of EndpointMap with the std::map it replaced.
+// Usage: bench_endpointmap [lookups]
+#include "endpointmap.h"
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static std::vector<asio::ip::udp::endpoint> makeEndpoints(size_t count, std::mt19937& rng)
+{
+	std::vector<asio::ip::udp::endpoint> endpoints;
+	std::map<asio::ip::udp::endpoint, int> seen;
+	while (endpoints.size() < count)
+	{
+		asio::ip::udp::endpoint ep(asio::ip::address_v4(rng()), (uint16_t)(1024 + rng() % 64512));
+		if (seen.emplace(ep, 0).second)
+			endpoints.push_back(ep);
+	}
+	return endpoints;
+}
+
+// Lookups of the endpoints in random order, as datagrams from all the players would arrive
+static std::vector<size_t> makeLookups(size_t players, size_t count, std::mt19937& rng)
+{
+	std::vector<size_t> lookups(count);
+	for (size_t& i : lookups)
+		i = rng() % players;
+	return lookups;
+}
+
+template<typename F>
+static double nsPerOp(size_t ops, F f)
+{
+	const Clock::time_point start = Clock::now();
+	f();
+	return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / ops;
+}
+
+static void bench(size_t players, size_t lookupCount)
+{
+	std::mt19937 rng(players);
+	const std::vector<asio::ip::udp::endpoint> endpoints = makeEndpoints(players, rng);
+	const std::vector<size_t> lookups = makeLookups(players, lookupCount, rng);
+	// Values stand in for the Player pointers
+	std::vector<int> values(players);
+
+	std::map<asio::ip::udp::endpoint, int *> stdMap;
+	EndpointMap<int *> flatMap;
+	const double stdInsert = nsPerOp(players, [&]() {
+		for (size_t i = 0; i < players; i++)
+			stdMap[endpoints[i]] = &values[i];
+	});
+	const double flatInsert = nsPerOp(players, [&]() {
+		for (size_t i = 0; i < players; i++)
+			flatMap.insert(endpoints[i], &values[i]);
+	});
+
+	size_t stdFound = 0;
+	const double stdFind = nsPerOp(lookupCount, [&]() {
+		for (size_t i : lookups)
+		{
+			auto it = stdMap.find(endpoints[i]);
+			if (it != stdMap.end())
+				stdFound += *it->second + 1;
+		}
+	});
+	size_t flatFound = 0;
+	const double flatFind = nsPerOp(lookupCount, [&]() {
+		for (size_t i : lookups)
+		{
+			int **p = flatMap.find(endpoints[i]);
+			if (p != nullptr)
+				flatFound += **p + 1;
+		}
+	});
+	if (stdFound != flatFound || flatFound != lookupCount)
+	{
+		fprintf(stderr, "%zd players: lookup mismatch\n", players);
+		exit(1);
+	}
+
+	// Players leaving and joining again
+	const double stdChurn = nsPerOp(players, [&]() {
+		for (size_t i = 0; i < players; i++) {
+			stdMap.erase(endpoints[i]);
+			stdMap[endpoints[i]] = &values[i];
+		}
+	});
+	const double flatChurn = nsPerOp(players, [&]() {
+		for (size_t i = 0; i < players; i++) {
+			flatMap.erase(endpoints[i]);
+			flatMap.insert(endpoints[i], &values[i]);
+		}
+	});
+
+	printf("%6zd players  find: std::map %6.1f ns  EndpointMap %6.1f ns  (x%.1f)   "
+			"insert: %6.1f / %6.1f ns   erase+insert: %6.1f / %6.1f ns\n",
+			players, stdFind, flatFind, stdFind / flatFind,
+			stdInsert, flatInsert, stdChurn, flatChurn);
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t lookups = argc >= 2 ? strtoul(argv[1], nullptr, 10) : 10000000;
+	for (size_t players : { 100, 1000, 10000 })
+		bench(players, lookups);
+
+	return 0;
+}
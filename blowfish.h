@@ -20,6 +20,7 @@ See blowfish.c for more information about this file.
 */
 #pragma once
 #include <inttypes.h>
+#include <stddef.h>
 
 typedef struct {
   uint32_t P[16 + 2];
@@ -29,3 +30,9 @@ typedef struct {
 void Blowfish_Init(BLOWFISH_CTX *ctx, uint8_t *key, int32_t keyLen);
 void Blowfish_Encrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr);
 void Blowfish_Decrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr);
+/* Encrypt or decrypt len / 8 big-endian 64-bit blocks in place (ECB mode) */
+void Blowfish_EncryptECB(const BLOWFISH_CTX *ctx, uint8_t *data, size_t len);
+void Blowfish_DecryptECB(const BLOWFISH_CTX *ctx, uint8_t *data, size_t len);
+/* Check the implementations against known answers. Must be called at startup.
+   Returns 0 on success, -1 on failure. */
+int Blowfish_SelfTest(void);
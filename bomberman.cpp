@@ -23,8 +23,12 @@
 
 using namespace std::chrono_literals;
 
+// Game data stream of the player positions, sent by all the game data commands.
+// The other fields use one stream per command, numbered after the command.
+static constexpr unsigned POSITION_STREAM = 0;
+
 BMRoom::BMRoom(Lobby& lobby, uint32_t id, const std::string& name, uint32_t attributes, Player *owner, asio::io_context& io_context)
-	: Room(lobby, id, name, attributes, owner, io_context), timer(io_context)
+	: Room(lobby, id, name, attributes, owner, io_context)
 {
 	// needed after the owner is added in the parent constructor
 	updateSlots();
@@ -46,12 +50,9 @@ bool BMRoom::removePlayer(Player *player)
 		updateSlots();
 		for (unsigned i = idx; i < players.size() - 1; i++)
 			states[i] = states[i + 1];
-		for (Player *pl : players)
-		{
-			Packet packet;
-			sendRosterList(packet);
-			pl->send(packet);
-		}
+		Packet packet;
+		sendRosterList(packet);
+		Player::sendToAll(packet, players);
 		if (wasOwner)
 			broadcastKeyholder();
 	}
@@ -705,10 +706,14 @@ bool BombermanServer::handlePacket(Player *player, const uint8_t *data, size_t l
 					Position p2(read16(data, 0x18));
 					DEBUG_LOG(Game::Bomberman, "GAME_DATA_1: P2 %g:%g %x %x", p2.xpos(), p2.ypos(), data[0x16], data[0x17]);
 				}
-				room->savePlayerCoords(player, data + 0x14);
-				room->saveTimestamp(player, data + 0x34);
-				room->saveBombState(player, data + 0x38);
-				room->saveBrickMap(player, data + 0xC8);
+				if (player->isFreshGameData(POSITION_STREAM, data))
+					room->savePlayerCoords(player, data + 0x14);
+				if (player->isFreshGameData(BMCmd::BOMB_DATA, data))
+				{
+					room->saveTimestamp(player, data + 0x34);
+					room->saveBombState(player, data + 0x38);
+					room->saveBrickMap(player, data + 0xC8);
+				}
 				room->makeCmd1Packet(player, replyPacket);
 				if (room->checkEndOfGame(player, BMCmd::BOMB_DATA, data[0x13]))
 				{
@@ -736,9 +741,13 @@ bool BombermanServer::handlePacket(Player *player, const uint8_t *data, size_t l
 				Position p1(read16(data, 0x14));
 				DEBUG_LOG(Game::Bomberman, "GAME_DATA_2: P1 %g:%g %x %x", p1.xpos(), p1.ypos(), data[0x16], data[0x17]);
 			}
-			room->savePlayerCoords(player, data + 0x14);
-			room->savePowerUps(player, data + 0x34);
-			room->saveBrickMap(player, data + 0xA4);
+			if (player->isFreshGameData(POSITION_STREAM, data))
+				room->savePlayerCoords(player, data + 0x14);
+			if (player->isFreshGameData(BMCmd::MAP_DATA, data))
+			{
+				room->savePowerUps(player, data + 0x34);
+				room->saveBrickMap(player, data + 0xA4);
+			}
 			room->makeCmd2Packet(replyPacket);
 			if (room->checkEndOfGame(player, BMCmd::MAP_DATA, data[0x13]))
 			{
@@ -757,7 +766,8 @@ bool BombermanServer::handlePacket(Player *player, const uint8_t *data, size_t l
 				Position p1(read16(data, 0x14));
 				DEBUG_LOG(Game::Bomberman, "GAME_DATA_3: P1 %g:%g %x %x", p1.xpos(), p1.ypos(), data[0x16], data[0x17]);
 			}
-			room->savePlayerCoords(player, data + 0x14);
+			if (player->isFreshGameData(POSITION_STREAM, data))
+				room->savePlayerCoords(player, data + 0x14);
 			room->makeCmd3Packet(replyPacket);
 			if (room->checkEndOfGame(player, BMCmd::POS_DATA, data[0x13]))
 			{
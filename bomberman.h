@@ -311,7 +311,6 @@ private:
 	};
 	std::array<State, 8> states;
 	std::vector<int> slots;	// slots used by each player
-	asio::steady_timer timer;
 	std::array<uint8_t, 9> rules {};
 	bool inGame = false;
 	bool gameStarting = false;
@@ -17,7 +17,12 @@
 */
 #include "discord.h"
 #include <dcserver/discord.hpp>
+#include <dcserver/status.hpp>
 #include <chrono>
+#include <mutex>
+
+// Game servers may run in different threads
+static std::mutex mutex;
 
 const char *getDCNetGameId(Game game)
 {
@@ -32,6 +37,7 @@ const char *getDCNetGameId(Game game)
 
 void discordLobbyJoined(Game gameId, const std::string& username, const std::vector<std::string>& playerList)
 {
+	std::lock_guard<std::mutex> _(mutex);
 	using the_clock = std::chrono::steady_clock;
 	static the_clock::time_point last_notif;
 	the_clock::time_point now = the_clock::now();
@@ -54,6 +60,47 @@ void discordGameCreated(Game gameId, const std::string& username, const std::str
 	for (const auto& player : playerList)
 		notif.embed.text += discordEscape(player) + "\n";
 
+	std::lock_guard<std::mutex> _(mutex);
 	discordNotif(getDCNetGameId(gameId), notif);
 }
 
+
+void statusJoin(Game gameId, const std::string& ip, uint16_t port, const std::string& username)
+{
+	std::lock_guard<std::mutex> _(mutex);
+	status::join(getDCNetGameId(gameId), ip, port, username);
+}
+
+void statusLeave(Game gameId, const std::string& ip, uint16_t port, const std::string& username)
+{
+	std::lock_guard<std::mutex> _(mutex);
+	status::leave(getDCNetGameId(gameId), ip, port, username);
+}
+
+void statusCreateGame(Game gameId)
+{
+	std::lock_guard<std::mutex> _(mutex);
+	status::createGame(getDCNetGameId(gameId));
+}
+
+void statusDeleteGame(Game gameId)
+{
+	std::lock_guard<std::mutex> _(mutex);
+	status::deleteGame(getDCNetGameId(gameId));
+}
+
+void statusReset(const char *gameId)
+{
+	std::lock_guard<std::mutex> _(mutex);
+	status::reset(gameId);
+}
+
+void statusPing(const char *gameId)
+{
+	std::lock_guard<std::mutex> _(mutex);
+	status::ping(gameId);
+}
+
+int statusPingInterval() {
+	return status::pingInterval();
+}
@@ -23,3 +23,12 @@
 void discordLobbyJoined(Game gameId, const std::string& username, const std::vector<std::string>& playerList);
 void discordGameCreated(Game gameId, const std::string& username, const std::string& gameName, const std::vector<std::string>& playerList);
 const char *getDCNetGameId(Game game);
+
+// Thread-safe wrappers around the dcnet status API
+void statusJoin(Game gameId, const std::string& ip, uint16_t port, const std::string& username);
+void statusLeave(Game gameId, const std::string& ip, uint16_t port, const std::string& username);
+void statusCreateGame(Game gameId);
+void statusDeleteGame(Game gameId);
+void statusReset(const char *gameId);
+void statusPing(const char *gameId);
+int statusPingInterval();
@@ -0,0 +1,132 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <dcserver/asio.hpp>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Open-addressing hash map keyed by IPv4 address and port.
+// Uses linear probing and backward shift deletion.
+template<typename T>
+class EndpointMap
+{
+	using Entry = std::pair<uint64_t, T>;
+
+public:
+	EndpointMap() {
+		entries.resize(MIN_CAPACITY, Entry{ EMPTY, T{} });
+	}
+
+	static uint64_t key(const asio::ip::udp::endpoint& endpoint) {
+		return ((uint64_t)endpoint.address().to_v4().to_uint() << 16) | endpoint.port();
+	}
+
+	T *find(const asio::ip::udp::endpoint& endpoint)
+	{
+		const uint64_t k = key(endpoint);
+		for (size_t i = slot(k);; i = (i + 1) & mask())
+		{
+			if (entries[i].first == k)
+				return &entries[i].second;
+			if (entries[i].first == EMPTY)
+				return nullptr;
+		}
+	}
+
+	void insert(const asio::ip::udp::endpoint& endpoint, const T& value)
+	{
+		if ((count + 1) * 2 > entries.size())
+			rehash(entries.size() * 2);
+		const uint64_t k = key(endpoint);
+		size_t i = slot(k);
+		while (entries[i].first != EMPTY && entries[i].first != k)
+			i = (i + 1) & mask();
+		if (entries[i].first == EMPTY)
+			count++;
+		entries[i] = Entry{ k, value };
+	}
+
+	bool erase(const asio::ip::udp::endpoint& endpoint)
+	{
+		const uint64_t k = key(endpoint);
+		size_t i = slot(k);
+		while (entries[i].first != k)
+		{
+			if (entries[i].first == EMPTY)
+				return false;
+			i = (i + 1) & mask();
+		}
+		// Move back the following entries that aren't in their home slot
+		for (size_t j = (i + 1) & mask(); entries[j].first != EMPTY; j = (j + 1) & mask())
+		{
+			const size_t home = slot(entries[j].first);
+			// move if home isn't in the cyclic range (i, j]
+			if (((j - home) & mask()) >= ((j - i) & mask()))
+			{
+				entries[i] = entries[j];
+				i = j;
+			}
+		}
+		entries[i] = Entry{ EMPTY, T{} };
+		count--;
+		return true;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	// Call f(value) for each entry
+	template<typename F>
+	void forEach(F f) const
+	{
+		for (const Entry& entry : entries)
+			if (entry.first != EMPTY)
+				f(entry.second);
+	}
+
+private:
+	static constexpr uint64_t EMPTY = ~0ull;
+	static constexpr size_t MIN_CAPACITY = 64;
+
+	size_t mask() const {
+		return entries.size() - 1;
+	}
+	size_t slot(uint64_t k) const {
+		return (size_t)((k * 0x9E3779B97F4A7C15ull) >> 32) & mask();
+	}
+
+	void rehash(size_t capacity)
+	{
+		std::vector<Entry> old(capacity, Entry{ EMPTY, T{} });
+		old.swap(entries);
+		for (const Entry& entry : old)
+		{
+			if (entry.first == EMPTY)
+				continue;
+			size_t i = slot(entry.first);
+			while (entries[i].first != EMPTY)
+				i = (i + 1) & mask();
+			entries[i] = entry;
+		}
+	}
+
+	std::vector<Entry> entries;
+	size_t count = 0;
+};
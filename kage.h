@@ -20,6 +20,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdexcept>
+#include <algorithm>
+#include <vector>
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -52,6 +54,57 @@ static inline void write32(uint8_t *p, unsigned offset, uint32_t v) {
 	*(uint32_t *)&p[offset] = htonl(v);
 }
 
+// Thread-local pool of zeroed packet buffers, by size class
+class PacketPool
+{
+public:
+	static constexpr unsigned ClassCount = 3;
+	static constexpr size_t ClassSizes[ClassCount] { 0x80, 0x200, 0x800 };
+	static constexpr size_t MaxSize = ClassSizes[ClassCount - 1];
+
+	static unsigned getSizeClass(size_t size)
+	{
+		for (unsigned i = 0; i < ClassCount; i++)
+			if (size <= ClassSizes[i])
+				return i;
+		throw std::runtime_error("Packet too big");
+	}
+
+	static uint8_t *acquire(unsigned sizeClass)
+	{
+		std::vector<uint8_t *>& list = freeLists[sizeClass].buffers;
+		if (list.empty())
+			return new uint8_t[ClassSizes[sizeClass]] {};
+		uint8_t *p = list.back();
+		list.pop_back();
+		return p;
+	}
+
+	// The buffer must be zeroed
+	static void release(uint8_t *p, unsigned sizeClass)
+	{
+		std::vector<uint8_t *>& list = freeLists[sizeClass].buffers;
+		if (list.size() < MaxFreeBuffers)
+			list.push_back(p);
+		else
+			delete[] p;
+	}
+
+private:
+	static constexpr size_t MaxFreeBuffers = 64;
+
+	struct FreeList
+	{
+		std::vector<uint8_t *> buffers;
+
+		~FreeList() {
+			for (uint8_t *p : buffers)
+				delete[] p;
+		}
+	};
+	static inline thread_local FreeList freeLists[ClassCount];
+};
+
 class Packet
 {
 public:
@@ -97,18 +150,84 @@ public:
 		FLAG_RUDP = 0x8000,		// RUDP
 	};
 
-	uint8_t data[0x800] {};
+	uint8_t *data;
 	uint16_t size = 0x10;
 	uint16_t startOffset = 0;
 	uint16_t flags = FLAG_UNKNOWN;
 	Command type = REQ_NOP;
 
+	Packet() {
+		data = PacketPool::acquire(0);
+	}
+	Packet(const Packet& other)
+		: size(other.size), startOffset(other.startOffset), flags(other.flags), type(other.type)
+	{
+		sizeClass = other.sizeClass;
+		used = other.used;
+		data = PacketPool::acquire(sizeClass);
+		memcpy(data, other.data, used);
+	}
+	Packet(Packet&& other)
+		: data(other.data), size(other.size), startOffset(other.startOffset), flags(other.flags), type(other.type)
+	{
+		sizeClass = other.sizeClass;
+		used = other.used;
+		other.data = PacketPool::acquire(0);
+		other.sizeClass = 0;
+		other.reset();
+	}
+	Packet& operator=(const Packet& other)
+	{
+		if (this != &other)
+		{
+			Packet copy(other);
+			*this = std::move(copy);
+		}
+		return *this;
+	}
+	Packet& operator=(Packet&& other)
+	{
+		std::swap(data, other.data);
+		std::swap(sizeClass, other.sizeClass);
+		std::swap(used, other.used);
+		size = other.size;
+		startOffset = other.startOffset;
+		flags = other.flags;
+		type = other.type;
+		other.reset();
+		return *this;
+	}
+	~Packet() {
+		memset(data, 0, used);
+		PacketPool::release(data, sizeClass);
+	}
+
+	// Make sure that len bytes can be written at the current position, plus the kage token.
+	// Bytes reserved are zeroed when the packet is reset.
+	void reserve(size_t len)
+	{
+		const size_t needed = size + len + sizeof(KageToken);
+		if (needed > PacketPool::ClassSizes[sizeClass])
+		{
+			unsigned newClass = PacketPool::getSizeClass(needed);
+			uint8_t *newData = PacketPool::acquire(newClass);
+			memcpy(newData, data, used);
+			memset(data, 0, used);
+			PacketPool::release(data, sizeClass);
+			data = newData;
+			sizeClass = newClass;
+		}
+		used = std::max<size_t>(used, needed);
+	}
+
 	void reset()
 	{
 		startOffset = 0;
 		size = 0x10;
 		this->type = REQ_NOP;
-		memset(data, 0, sizeof(data));
+		// only clear what has been written
+		memset(data, 0, used);
+		used = 0x10;
 		flags = FLAG_UNKNOWN;
 	}
 
@@ -133,23 +252,28 @@ public:
 	}
 
 	void writeData(uint32_t v) {
+		reserve(sizeof(v));
 		write32(data, size, v);
 		size += sizeof(v);
 	}
 	void writeData(uint16_t v) {
+		reserve(sizeof(v));
 		write16(data, size, v);
 		size += sizeof(v);
 	}
 	void writeData(uint8_t v) {
+		reserve(sizeof(v));
 		data[size] = v;
 		size += sizeof(v);
 	}
 	void writeData(const uint8_t *data, int size) {
+		reserve(size);
 		memcpy(&this->data[this->size], data, size);
 		this->size += size;
 	}
 	void writeData(const char *str, int size)
 	{
+		reserve(size);
 		strncpy((char *)&this->data[this->size], str, size);
 		int l = std::min<int>(size, strlen(str));
 		size -= l;
@@ -159,17 +283,20 @@ public:
 	}
 
 	void ack(uint32_t seq) {
+		used = std::max<size_t>(used, startOffset + 0x10);
 		flags |= Packet::FLAG_ACK;
 		write32(data, startOffset + 0xc, seq);
 	}
 
 	void relay(uint32_t playerId) {
+		used = std::max<size_t>(used, startOffset + 8);
 		flags |= Packet::FLAG_RELAY;
 		write32(data, startOffset + 4, playerId);
 	}
 
 	uint8_t *advance(int size)
 	{
+		reserve(size);
 		uint8_t *p = &this->data[this->size];
 		this->size += size;
 		return p;
@@ -180,6 +307,7 @@ public:
 		const uint16_t chunkSize = size - startOffset;
 		if (chunkSize > 0x3ff)
 			throw std::runtime_error("Packet too big");
+		reserve(0);
 		write16(data, startOffset, flags | chunkSize);
 		data[startOffset + 3] = type;
 		memcpy(&data[size], &KageToken, sizeof(KageToken));
@@ -191,6 +319,7 @@ public:
 		if (startOffset == 0)
 			write16(data, 0, read16(data, 0) | FLAG_CONTINUE);
 		startOffset = size;
+		reserve(0x10);
 		// reset kage token to 0
 		memset(&data[size], 0, sizeof(KageToken));
 		size += 0x10;
@@ -203,4 +332,8 @@ public:
 	}
 
 	static constexpr uint32_t KageToken = 0x106647BA;
+
+private:
+	unsigned sizeClass = 0;
+	size_t used = 0x10;	// number of bytes that may have been written
 };
@@ -23,14 +23,15 @@
 #include "bomberman.h"
 #include "outtrigger.h"
 #include "log.h"
+#include "discord.h"
 #include <dcserver/asio.hpp>
-#include <dcserver/status.hpp>
 extern "C" {
 #include "blowfish.h"
 }
 #include <map>
 #include <fstream>
 #include <sstream>
+#include <thread>
 
 #ifndef DATADIR
 #define DATADIR "."
@@ -44,17 +45,28 @@ std::string DataDir;
 class BootstrapServer : public Server
 {
 public:
-	BootstrapServer(asio::ip::address_v4 address, uint16_t port, asio::io_context& io_context)
+	// Each game server can run on its own io_context
+	BootstrapServer(asio::ip::address_v4 address, uint16_t port, asio::io_context& io_context,
+			asio::io_context& bmContext, asio::io_context& otContext, asio::io_context& paContext)
 		: Server(port, io_context),
 		  address(address),
-		  bombermanServer(BOMBERMAN_PORT, io_context),
-		  outtriggerServer(OUTTRIGGER_PORT, io_context),
-		  propellerServer(PROPELLERA_PORT, io_context),
-		  statusTimer(io_context)
+		  bombermanServer(BOMBERMAN_PORT, bmContext),
+		  outtriggerServer(OUTTRIGGER_PORT, otContext),
+		  propellerServer(PROPELLERA_PORT, paContext),
+		  statusTimer(io_context),
+		  bombermanCtx(makeBlowfishCtx(BombermanKey)),
+		  outtriggerCtx(makeBlowfishCtx(OuttriggerKey)),
+		  propellerCtx(makeBlowfishCtx(PropellerKey))
 	{
 	}
 
 	void start();
+	// Stop the threads of the game servers
+	void stop() {
+		bombermanServer.stop();
+		outtriggerServer.stop();
+		propellerServer.stop();
+	}
 	void onUpdateTimer(const std::error_code& ec);
 
 private:
@@ -72,10 +84,60 @@ private:
 	static constexpr const char *OuttriggerKey = "reggirttuO";
 	static constexpr const char *PropellerKey = "ArelleporP";
 	static constexpr const char *BombermanKey = "Hudson2001";
+
+	static BLOWFISH_CTX makeBlowfishCtx(const char *key)
+	{
+		BLOWFISH_CTX ctx;
+		Blowfish_Init(&ctx, (uint8_t *)key, strlen(key));
+		return ctx;
+	}
+	// Key schedules of the login reply ciphers, only computed once
+	const BLOWFISH_CTX bombermanCtx;
+	const BLOWFISH_CTX outtriggerCtx;
+	const BLOWFISH_CTX propellerCtx;
 };
 
+static void configureRUdp(LobbyServer& server, const std::string& prefix)
+{
+	LobbyServer::RUdpConfig config = server.getRUdpConfig();
+	// Per-game settings override the global ones
+	for (const std::string& p : { std::string(), prefix + "_" })
+	{
+		if (Config.count(p + "RUDP_WINDOW") > 0)
+			config.window = atoi(Config[p + "RUDP_WINDOW"].c_str());
+		if (Config.count(p + "RUDP_MIN_RTO") > 0)
+			config.minRto = std::chrono::milliseconds(atoi(Config[p + "RUDP_MIN_RTO"].c_str()));
+		if (Config.count(p + "RUDP_MAX_RTO") > 0)
+			config.maxRto = std::chrono::milliseconds(atoi(Config[p + "RUDP_MAX_RTO"].c_str()));
+		if (Config.count(p + "RUDP_MAX_ATTEMPTS") > 0)
+			config.maxAttempts = atoi(Config[p + "RUDP_MAX_ATTEMPTS"].c_str());
+		if (Config.count(p + "RUDP_MAX_QUEUE") > 0)
+			config.maxQueue = atoi(Config[p + "RUDP_MAX_QUEUE"].c_str());
+		if (Config.count(p + "RUDP_BACKOFF") > 0)
+			config.backoff = Config[p + "RUDP_BACKOFF"] == "linear" ? LobbyServer::RUdpConfig::Backoff::Linear
+					: LobbyServer::RUdpConfig::Backoff::Exponential;
+	}
+	server.setRUdpConfig(config);
+}
+
+static void configureRoomThreads(LobbyServer& server, const std::string& prefix)
+{
+	// The per-game setting overrides the global one
+	std::string key = prefix + "_ROOM_THREADS";
+	if (Config.count(key) == 0)
+		key = "ROOM_THREADS";
+	if (Config.count(key) > 0)
+		server.setRoomThreads(std::max(0, atoi(Config[key].c_str())));
+}
+
 void BootstrapServer::start()
 {
+	configureRUdp(bombermanServer, "BM");
+	configureRUdp(outtriggerServer, "OT");
+	configureRUdp(propellerServer, "PA");
+	configureRoomThreads(bombermanServer, "BM");
+	configureRoomThreads(outtriggerServer, "OT");
+	configureRoomThreads(propellerServer, "PA");
 	bombermanServer.start();
 	outtriggerServer.start();
 	propellerServer.start();
@@ -94,12 +156,12 @@ void BootstrapServer::handlePacket(const uint8_t *data, size_t len)
 			uint16_t port;
 			LobbyServer *server;
 			std::string name;
-			const char *key;
+			const BLOWFISH_CTX *ctx;
 			if (!strcmp((const char *)&data[0x10], "BombermanOnline"))
 			{
 				port = BOMBERMAN_PORT;
 				server = &bombermanServer;
-				key = BombermanKey;
+				ctx = &bombermanCtx;
 				name = (const char *)&data[0x38];
 				auto sep = name.find('\1');
 				if (sep != std::string::npos)
@@ -110,14 +172,14 @@ void BootstrapServer::handlePacket(const uint8_t *data, size_t len)
 			{
 				port = PROPELLERA_PORT;
 				server = &propellerServer;
-				key = PropellerKey;
+				ctx = &propellerCtx;
 				name = (const char *)&data[0x38];	// FIXME this is the game key but no user name
 			}
 			else {
 				// Outtrigger
 				port = OUTTRIGGER_PORT;
 				server = &outtriggerServer;
-				key = OuttriggerKey;
+				ctx = &outtriggerCtx;
 				name = (const char *)&data[0x10];
 			}
 
@@ -131,29 +193,17 @@ void BootstrapServer::handlePacket(const uint8_t *data, size_t len)
 			packet.writeData(0u);
 			packet.writeData(0u);
 			packet.writeData(0u); // size of following data, sent back when logging to lobby
-			packet.size = ((packet.size + 7) / 8) * 8;
-			BLOWFISH_CTX *ctx = new BLOWFISH_CTX();
-			Blowfish_Init(ctx, (uint8_t *)key, strlen(key));
-			for (int i = 0x10; i < packet.size; i += 8)
-			{
-				uint32_t *x = (uint32_t *)&packet.data[i];
-				x[0] = ntohl(x[0]);
-				x[1] = ntohl(x[1]);
-				Blowfish_Encrypt(ctx, x, x + 1);
-				x[0] = htonl(x[0]);
-				x[1] = htonl(x[1]);
-			}
+			packet.advance(((packet.size + 7) / 8) * 8 - packet.size);
+			Blowfish_EncryptECB(ctx, &packet.data[0x10], packet.size - 0x10);
 
-			Player *player = new Player(*server, source, nextUserId, io_context);
-			player->setName(name);
-			server->addPlayer(player);
+			server->createPlayer(source, nextUserId, name);
 			nextUserId++;
 
 			size_t pktsize = packet.finalize();
 			write32(packet.data, 4, tmpUserId);
-			write32(packet.data, 8, player->getUnrelSeqAndInc());
-			std::error_code ec2;
-			socket.send_to(asio::buffer(packet.data, pktsize), source, 0, ec2);
+			// first unreliable sequence number of the new player
+			write32(packet.data, 8, 0);
+			sendDatagram(packet.data, pktsize, source);
 			break;
 		}
 
@@ -163,8 +213,7 @@ void BootstrapServer::handlePacket(const uint8_t *data, size_t len)
 			packet.writeData(read32(data, 0x10));
 			size_t pktsize = packet.finalize();
 			write32(packet.data, 4, read32(data, 4));
-			std::error_code ec2;
-			socket.send_to(asio::buffer(packet.data, pktsize), source, 0, ec2);
+			sendDatagram(packet.data, pktsize, source);
 			break;
 		}
 
@@ -186,10 +235,10 @@ void BootstrapServer::onUpdateTimer(const std::error_code& ec)
 	if (ec)
 		return;
 	if (statusTimer.expiry().time_since_epoch() == 0ms)
-		status::reset("kage");
+		statusReset("kage");
 	else
-		status::ping("kage");
-	statusTimer.expires_after(asio::chrono::seconds(status::pingInterval()));
+		statusPing("kage");
+	statusTimer.expires_after(asio::chrono::seconds(statusPingInterval()));
 	statusTimer.async_wait(std::bind(&BootstrapServer::onUpdateTimer, this, asio::placeholders::error));
 }
 
@@ -237,17 +286,37 @@ int main(int argc, char *argv[])
 {
 	setvbuf(stdout, nullptr, _IOLBF, BUFSIZ);
 
-	asio::io_context io_context;
+	loadConfig(argc >= 2 ? argv[1] : "kage.cfg");
+	// Run each game server, the bootstrap server, auth and rank services in their own thread
+	const bool threads = Config.count("THREADS") > 0 && atoi(Config["THREADS"].c_str()) != 0;
+	// bootstrap, bomberman, outtrigger, propeller, auth, rank
+	std::vector<std::unique_ptr<asio::io_context>> contexts;
+	for (int i = 0; i < (threads ? 6 : 1); i++)
+		contexts.push_back(std::make_unique<asio::io_context>());
+	auto getContext = [&contexts](int i) -> asio::io_context& {
+		return *contexts[i % contexts.size()];
+	};
+	asio::io_context& io_context = getContext(0);
 	asio::signal_set signals(io_context, SIGINT, SIGTERM);
-	signals.async_wait([&io_context](const std::error_code& ec, int signalNum) {
+	signals.async_wait([&contexts](const std::error_code& ec, int signalNum) {
 		if (!ec) {
 			ERROR_LOG(Game::None, "Caught signal %d. Exiting", signalNum);
-			io_context.stop();
+			for (auto& context : contexts)
+				context->stop();
 		}
 	});
-	loadConfig(argc >= 2 ? argv[1] : "kage.cfg");
 	if (Config.count("DUMP_NET_DATA") > 0)
 		Room::DumpNetData = atoi(Config["DUMP_NET_DATA"].c_str()) != 0;
+	if (Config.count("BATCH_RECV") > 0)
+		Server::BatchRecv = atoi(Config["BATCH_RECV"].c_str()) != 0;
+	if (Config.count("RECV_THREADS") > 0)
+		LobbyServer::RecvThreads = std::max(1, atoi(Config["RECV_THREADS"].c_str()));
+
+	if (Blowfish_SelfTest() != 0)
+	{
+		ERROR_LOG(Game::None, "Blowfish self-test failed. Exiting");
+		return 1;
+	}
 
 	std::string serverIp = Config["SERVER_IP"];
 	if (serverIp.empty()) {
@@ -258,19 +327,35 @@ int main(int argc, char *argv[])
 	if (DataDir.empty())
 		DataDir = DATADIR;
 	asio::ip::address_v4 serverAddr = asio::ip::address_v4::from_string(serverIp);
-	BootstrapServer server(serverAddr, 9090, io_context);
+	BootstrapServer server(serverAddr, 9090, io_context, getContext(1), getContext(2), getContext(3));
 	server.start();
-	AuthAcceptor authServer(io_context);
+	unsigned authCryptoThreads = 1;
+	if (Config.count("AUTH_CRYPTO_THREADS") > 0)
+		authCryptoThreads = std::max(0, atoi(Config["AUTH_CRYPTO_THREADS"].c_str()));
+	AuthAcceptor authServer(getContext(4), authCryptoThreads);
 	authServer.start();
 
-	RankAcceptor rankServer(io_context, DataDir + "/propellerarena.db");
+	RankAcceptor rankServer(getContext(5), DataDir + "/propellerarena.db");
 	rankServer.start();
-	NOTICE_LOG(Game::None, "Kage server started");
-	try {
-		io_context.run();
-	} catch (const std::exception& e) {
-		ERROR_LOG(Game::None, "Uncaught exception: %s", e.what());
-	}
+	NOTICE_LOG(Game::None, "Kage server started%s", threads ? " (threaded)" : "");
+	auto run = [&contexts](asio::io_context& context) {
+		try {
+			context.run();
+		} catch (const std::exception& e) {
+			ERROR_LOG(Game::None, "Uncaught exception: %s", e.what());
+		}
+		// stop everything if one thread exits
+		for (auto& context : contexts)
+			context->stop();
+	};
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < contexts.size(); i++)
+		workers.emplace_back(run, std::ref(*contexts[i]));
+	run(io_context);
+	for (std::thread& thread : workers)
+		thread.join();
+	// Room workers may still update the rank database
+	server.stop();
 	NOTICE_LOG(Game::None, "Kage server stopped");
 
 	return 0;
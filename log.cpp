@@ -44,7 +44,8 @@ void logger(Log::LEVEL level, Game game, const char* file, int line, const char
 	va_end(args);
 
 	time_t now = time(nullptr);
-	struct tm tm = *localtime(&now);
+	struct tm tm;
+	localtime_r(&now, &tm);
 
 	char *msg;
 	if (game < Game::None || game > Game::PropellerA)
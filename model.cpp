@@ -17,37 +17,203 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include "model.h"
+#include "roomworker.h"
+#include "recvshard.h"
 #include "discord.h"
 #include "log.h"
-#include <dcserver/status.hpp>
 #include <algorithm>
 #include <cctype>
+#include <cinttypes>
+#include <cmath>
 
 using namespace std::chrono_literals;
 
-Player::~Player() {
-	std::error_code ec;
-	timer.cancel(ec);
+Player::Player(LobbyServer& server, const asio::ip::udp::endpoint& endpoint, uint32_t id, asio::io_context& io_context)
+	: server(server), id(id), endpoint(endpoint),
+	  resendTimer(server.getTimerWheel(), [this]() { onResendTimer(); }),
+	  idleTimer(server.getTimerWheel(), [this]() { onIdleTimer(); })
+{
+	// Players are created from a posted handler so the cached time may be stale
+	server.getTimerWheel().updateTime();
+	setAlive();
+	idleTimer.expiresAt(lastTime + 30s);
+}
+
+ListWriter::ListWriter(Packet& packet, Game game, const Player *player, const uint8_t *header, size_t headerSize)
+	: packet(packet), game(game), player(player)
+{
+	packet.writeData(header, headerSize);
+	countOffset = packet.size;
+	packet.writeData(0u);
+}
+
+uint8_t *ListWriter::add(size_t size)
+{
+	if (truncated > 0
+			|| packet.size - packet.startOffset + size > 0x3ff
+			|| packet.size + size + sizeof(Packet::KageToken) > MaxDatagramSize)
+	{
+		truncated++;
+		return nullptr;
+	}
+	count++;
+	// Entries are zero-filled
+	return packet.advance(size);
+}
+
+void ListWriter::finish()
+{
+	write32(packet.data, countOffset, count);
+	if (truncated > 0)
+		WARN_LOG(game, "[%s] list reply %x truncated: %u of %u entries sent", player->getName().c_str(),
+				(int)packet.type, count, count + truncated);
+}
+
+uint32_t Roster::entrySize(const Player *player) {
+	return 0x10 + 2 * sizeof(uint32_t) + (uint32_t)player->getExtraData().size();
+}
+
+void Roster::write(const Player *player, uint8_t *p)
+{
+	memset(p, 0, 0x10);
+	strncpy((char *)p, player->getName().c_str(), 0x10);
+	write32(p, 0x10, player->getId());
+	const auto& extra = player->getExtraData();
+	write32(p, 0x14, (uint32_t)extra.size());
+	if (!extra.empty())
+		memcpy(p + 0x18, extra.data(), extra.size());
+}
+
+int Roster::find(const Player *player) const
+{
+	for (unsigned i = 0; i < entries.size(); i++)
+		if (entries[i].player == player)
+			return i;
+	return -1;
+}
+
+void Roster::add(const Player *player)
+{
+	const uint32_t offset = (uint32_t)data.size();
+	const uint32_t size = entrySize(player);
+	data.resize(offset + size);
+	write(player, &data[offset]);
+	entries.push_back({ player, offset, size });
+}
+
+void Roster::remove(const Player *player)
+{
+	int i = find(player);
+	if (i < 0)
+		return;
+	const Entry entry = entries[i];
+	data.erase(data.begin() + entry.offset, data.begin() + entry.offset + entry.size);
+	entries.erase(entries.begin() + i);
+	for (unsigned j = i; j < entries.size(); j++)
+		entries[j].offset -= entry.size;
+}
+
+void Roster::update(const Player *player)
+{
+	int i = find(player);
+	if (i < 0)
+		return;
+	Entry& entry = entries[i];
+	const uint32_t size = entrySize(player);
+	if (size > entry.size)
+		data.insert(data.begin() + entry.offset + entry.size, size - entry.size, 0);
+	else if (size < entry.size)
+		data.erase(data.begin() + entry.offset + size, data.begin() + entry.offset + entry.size);
+	const int32_t delta = (int32_t)size - (int32_t)entry.size;
+	entry.size = size;
+	write(player, &data[entry.offset]);
+	for (unsigned j = i + 1; j < entries.size(); j++)
+		entries[j].offset += delta;
+}
+
+const uint8_t *Roster::getEntry(const Player *player, size_t& size) const
+{
+	int i = find(player);
+	if (i < 0)
+		return nullptr;
+	size = entries[i].size;
+	return &data[entries[i].offset];
+}
+
+void Player::setName(const std::string& name)
+{
+	const bool indexed = server.removeName(this);
+	this->name = name;
+	if (indexed)
+		server.addName(this);
+	if (lobby != nullptr)
+		lobby->updateRoster(this);
+	if (room != nullptr)
+		room->updateRoster(this);
+}
+
+void Player::setExtraData(const uint8_t *data, unsigned size)
+{
+	extraData.resize(size);
+	if (size != 0)
+		memcpy(extraData.data(), data, size);
+	if (lobby != nullptr)
+		lobby->updateRoster(this);
+	if (room != nullptr)
+		room->updateRoster(this);
 }
 
 void Player::setAlive() {
-	lastTime = Clock::now();
+	lastTime = server.now();
 }
 
 bool Player::timedOut() const
 {
 	if (room == nullptr)
-		return Clock::now() - lastTime >= 2min;
+		return server.now() - lastTime >= 2min;
 	else
-		return Clock::now() - lastTime >= 30s;
+		return server.now() - lastTime >= 30s;
+}
+
+void Player::onIdleTimer()
+{
+	if (relOverflow)
+	{
+		INFO_LOG(server.game, "Player %s dropped: too many unacked packets", name.c_str());
+		// deletes this player
+		server.removePlayer(this);
+		return;
+	}
+	if (timedOut())
+	{
+		INFO_LOG(server.game, "Player %s has timed out", name.c_str());
+		// deletes this player
+		server.removePlayer(this);
+		return;
+	}
+	const time_point now = server.now();
+	if (room == nullptr && lastTime + 30s <= now)
+	{
+		// Send a reliable NOP and expect an ack
+		Packet packet;
+		packet.init(Packet::REQ_NOP);
+		packet.flags |= Packet::FLAG_RUDP;
+		send(packet);
+		idleTimer.expiresAt(std::min(now + 30s, lastTime + 2min));
+	}
+	else {
+		idleTimer.expiresAt(lastTime + 30s);
+	}
 }
 
-void Player::send(Packet& packet)
+SharedPacket::Ptr SharedPacket::create(Packet& packet, uint64_t supersedeKey)
 {
-	packet.finalize();
-	// Loop through all packets and set the player id (offset 4) and sequence number (offset 8)
+	std::shared_ptr<SharedPacket> shared = std::make_shared<SharedPacket>();
+	shared->supersedeKey = supersedeKey;
+	size_t size = packet.finalize();
+	shared->data.assign(packet.data, packet.data + size);
+	// Loop through all packets and find where the player id (offset 4) and sequence number (offset 8) go
 	size_t i = 0;
-	bool rudpSeen = false;
 	while (i < packet.size)
 	{
 		uint16_t size = read16(packet.data, i);
@@ -57,82 +223,213 @@ void Player::send(Packet& packet)
 		if (flags & Packet::FLAG_RUDP)
 		{
 			// Only the first reliable packet has a seq#
-			if (!rudpSeen)
-				write32(packet.data, i + 8, relSeq++);
-			rudpSeen = true;
+			if (!shared->reliable)
+				shared->patches.push_back({ (uint16_t)(i + 8), Patch::RelSeq });
+			shared->reliable = true;
 		}
 		else if (com != Packet::REQ_NOP) {
 			// unreliable NOPs don't have a seq#
-			write32(packet.data, i + 8, unrelSeq++);
+			shared->patches.push_back({ (uint16_t)(i + 8), Patch::UnrelSeq });
+			shared->unrelSeqCount++;
 		}
 		if (!(flags & Packet::FLAG_RELAY))
-			write32(packet.data, i + 4, id);
+			shared->patches.push_back({ (uint16_t)(i + 4), Patch::PlayerId });
 		i += size;
 	}
-	if (rudpSeen)
-		sendRel(packet, relSeq - 1);
-	else
-		server.send(packet, getEndpoint());
+	return shared;
 }
 
-void Player::sendToAll(Packet& packet, const std::vector<Player *>& players, Player *except)
+void SharedPacket::writeTo(uint8_t *dest, uint32_t playerId, uint32_t relSeq, uint32_t unrelSeq) const
 {
-	for (Player *pl : players)
-		if (pl != except)
-			pl->send(packet);
+	memcpy(dest, data.data(), data.size());
+	for (const Patch& patch : patches)
+	{
+		switch (patch.field)
+		{
+		case Patch::PlayerId:
+			write32(dest, patch.offset, playerId);
+			break;
+		case Patch::RelSeq:
+			write32(dest, patch.offset, relSeq);
+			break;
+		case Patch::UnrelSeq:
+			write32(dest, patch.offset, unrelSeq++);
+			break;
+		}
+	}
 }
 
-void Player::sendRel(Packet& packet, uint32_t seq)
+void Player::send(const SharedPacket::Ptr& packet)
 {
-	if ((int)seq == ackedRelSeq + 1)
+	if (packet->isReliable())
 	{
-		lastRelPacket = packet;
-		sendCount = 0;
-		resendTimer({});
+		if (relOverflow)
+			return;
+		if (packet->getSupersedeKey() != 0 && packet->getUnrelSeqCount() == 0)
+			supersede(packet->getSupersedeKey());
+		if (relQueue.size() >= server.getRUdpConfig().maxQueue)
+		{
+			WARN_LOG(server.game, "Reliable queue of %s is full (%d packets)", name.c_str(), (int)relQueue.size());
+			relOverflow = true;
+			// the idle timer handler drops the player
+			idleTimer.expiresAt(server.now());
+			return;
+		}
+	}
+	const uint32_t unrelSeq = this->unrelSeq;
+	this->unrelSeq += packet->getUnrelSeqCount();
+	if (packet->isReliable())
+	{
+		relQueue.push_back({ packet, relSeq++, unrelSeq });
+		fillRelWindow();
+		startResendTimer();
 	}
 	else {
-		relQueue.push_back(std::make_pair(seq, packet));
+		packet->writeTo(server.queueDatagram(packet->getSize(), endpoint, room != nullptr), id, 0, unrelSeq);
 	}
 }
 
-void Player::resendTimer(const std::error_code& ec)
+void Player::sendToAll(Packet& packet, const std::vector<Player *>& players, Player *except, uint64_t supersedeKey)
 {
-	if (ec)
+	SharedPacket::Ptr shared = SharedPacket::create(packet, supersedeKey);
+	for (Player *pl : players)
+		if (pl != except)
+			pl->send(shared);
+}
+
+// Remove the queued packet with the given key if it hasn't been sent yet
+void Player::supersede(uint64_t key)
+{
+	for (size_t i = relInFlight; i < relQueue.size(); i++)
+	{
+		const RelPacket& queued = relQueue[i];
+		if (queued.packet->getSupersedeKey() != key || queued.packet->getUnrelSeqCount() != 0)
+			continue;
+		const uint32_t seq = queued.seq;
+		relQueue.erase(relQueue.begin() + i);
+		// Packets that haven't been sent can be renumbered
+		for (; i < relQueue.size(); i++)
+			relQueue[i].seq--;
+		relSeq--;
+		if (waitingForSeq > (int)seq)
+			waitingForSeq--;
 		return;
-	if (sendCount >= 4)
+	}
+}
+
+void Player::fillRelWindow()
+{
+	const unsigned window = server.getRUdpConfig().window;
+	while (relInFlight < window && relInFlight < relQueue.size())
+		transmit(relQueue[relInFlight++]);
+}
+
+void Player::transmit(RelPacket& packet)
+{
+	const LobbyServer::RUdpConfig& config = server.getRUdpConfig();
+	packet.sendCount++;
+	packet.lastSend = server.now();
+	std::chrono::milliseconds timeout = rto;
+	if (config.backoff == LobbyServer::RUdpConfig::Backoff::Exponential)
+		timeout *= 1 << std::min(packet.sendCount - 1, 16);
+	else
+		timeout *= packet.sendCount;
+	packet.deadline = packet.lastSend + std::min(timeout, config.maxRto);
+	packet.packet->writeTo(server.queueDatagram(packet.packet->getSize(), endpoint, room != nullptr),
+			id, packet.seq, packet.unrelSeq);
+}
+
+void Player::updateRtt(std::chrono::steady_clock::duration sample)
+{
+	const float r = sample / 1.0ms;
+	if (!rttSampled)
 	{
-		WARN_LOG(server.game, "Sending packet %x to %s failed after %d attempts (ping %d)",
-				lastRelPacket.data[3], name.c_str(), sendCount, (int)ping);
-		ackedRelSeq++;
-		if (!relQueue.empty()) {
-			sendRel(relQueue.front().second, relQueue.front().first);
-			relQueue.pop_front();
-		}
+		srtt = r;
+		rttVar = r / 2.f;
+		rttSampled = true;
+	}
+	else
+	{
+		rttVar = rttVar * 0.75f + std::abs(srtt - r) * 0.25f;
+		srtt = srtt * 0.875f + r * 0.125f;
+	}
+	const LobbyServer::RUdpConfig& config = server.getRUdpConfig();
+	rto = std::chrono::milliseconds((int)(srtt + std::max(1.f, 4.f * rttVar)));
+	rto = std::clamp(rto, config.minRto, config.maxRto);
+}
+
+void Player::startResendTimer()
+{
+	if (relInFlight == 0)
+	{
+		resendTimer.cancel();
 		return;
 	}
-	sendCount++;
-	server.send(lastRelPacket, getEndpoint());
-	lastRUdpSend = Clock::now();
-	timer.expires_after(std::chrono::milliseconds((int)ping) + sendCount * 200ms);
-	// game (bba) apparently retries after 100 ms, 200 ms, 400 ms, 800 ms then timeout
-	// propeller arena: 200 ms, 400 ms, 600 ms, 800 ms, timeout
-	timer.async_wait(std::bind(&Player::resendTimer, this, asio::placeholders::error));
+	time_point deadline = relQueue.front().deadline;
+	for (unsigned i = 1; i < relInFlight; i++)
+		deadline = std::min(deadline, relQueue[i].deadline);
+	if (!resendTimer.pending() || deadline != resendTimer.expiry())
+		resendTimer.expiresAt(deadline);
+}
+
+void Player::onResendTimer()
+{
+	const time_point now = server.now();
+	// Give up on the packets that have been sent too many times, and on the packets before them
+	const int maxAttempts = server.getRUdpConfig().maxAttempts;
+	unsigned failed = 0;
+	for (unsigned i = 0; i < relInFlight; i++)
+		if (relQueue[i].deadline <= now && relQueue[i].sendCount >= maxAttempts)
+			failed = i + 1;
+	for (; failed > 0; failed--)
+	{
+		const RelPacket& packet = relQueue.front();
+		WARN_LOG(server.game, "Sending packet %x to %s failed after %d attempts (srtt %d rttvar %d rto %d)",
+				packet.packet->getCommand(), name.c_str(), packet.sendCount,
+				(int)srtt, (int)rttVar, (int)rto.count());
+		ackedRelSeq = packet.seq;
+		relQueue.pop_front();
+		relInFlight--;
+	}
+	for (unsigned i = 0; i < relInFlight; i++)
+		if (relQueue[i].deadline <= now)
+			transmit(relQueue[i]);
+	fillRelWindow();
+	startResendTimer();
 }
 
 void Player::ackRUdp(uint32_t seq)
 {
 	if (ackedRelSeq >= (int)seq)
+	{
 		// already ack'ed
+		if (relInFlight > 0 && (int)seq == ackedRelSeq && isDuplicateAck() && ++dupAckCount == 3)
+		{
+			// fast retransmit of the first unacked packet
+			dupAckCount = 0;
+			transmit(relQueue.front());
+			startResendTimer();
+		}
 		return;
+	}
 	ackedRelSeq = seq;
-	std::error_code ec;
-	timer.cancel(ec);
-	ping = ping * 0.5f + (Clock::now() - lastRUdpSend) / 1.0ms * 0.5f;
-	if (!relQueue.empty()) {
-		sendRel(relQueue.front().second, relQueue.front().first);
+	dupAckCount = 0;
+	// Acks are cumulative
+	time_point lastSend;
+	bool retransmitted = false;
+	while (relInFlight > 0 && (int)relQueue.front().seq <= ackedRelSeq)
+	{
+		lastSend = relQueue.front().lastSend;
+		retransmitted = relQueue.front().sendCount > 1;
 		relQueue.pop_front();
+		relInFlight--;
 	}
-	if (seq == (unsigned)waitingForSeq)
+	// Ignore ambiguous samples from retransmitted packets (Karn's algorithm)
+	if (lastSend != time_point() && !retransmitted)
+		updateRtt(server.now() - lastSend);
+	fillRelWindow();
+	startResendTimer();
+	if (waitingForSeq >= 0 && (int)seq >= waitingForSeq)
 	{
 		waitingForSeq = -1;
 		if (room != nullptr)
@@ -140,26 +437,152 @@ void Player::ackRUdp(uint32_t seq)
 	}
 }
 
+// Acks are piggy-backed on every packet so a repeated ack only hints at a loss if it was sent
+// after the client should have received a newer packet, and after the first packet was last sent.
+bool Player::isDuplicateAck() const
+{
+	const time_point sentBefore = server.now() - std::chrono::microseconds((int64_t)(srtt * 1000.f));
+	if (relQueue.front().lastSend > sentBefore)
+		return false;
+	for (unsigned i = 1; i < relInFlight; i++)
+		if (relQueue[i].lastSend <= sentBefore)
+			return true;
+	return false;
+}
+
 void Player::ackPacket(Packet& outPacket, const uint8_t *inPacket)
 {
 	if ((read16(inPacket, 0) & Packet::FLAG_RUDP) == 0)
 		// Not an RUdp packet
 		return;
-	uint32_t seq = read32(inPacket, 8);
-	if (seq != 0 || ackedClientSeq < (int)seq)
+	// Duplicates are filtered out by receiveReliable()
+	outPacket.ack(read32(inPacket, 8));
+}
+
+Player::RecvResult Player::receiveReliable(uint32_t seq, uint32_t lastSeq, const uint8_t *datagram, size_t len)
+{
+	// The first reliable packet received sets the sequence
+	if (ackedClientSeq < 0 || seq == (uint32_t)ackedClientSeq + 1)
 	{
-		outPacket.ack(seq);
-		if ((int)seq > ackedClientSeq)
-			ackedClientSeq = seq;
+		advanceClientSeq(lastSeq);
+		recvReplayPending = false;
+		return RecvResult::InOrder;
 	}
+	if ((int)seq <= ackedClientSeq)
+		return RecvResult::Duplicate;
+	if (seq - (uint32_t)ackedClientSeq > RECV_WINDOW || recvBuffer.size() >= RECV_WINDOW)
+		// Not acked so the client will send it again
+		return RecvResult::Dropped;
+	for (const RecvDatagram& recv : recvBuffer)
+		if (recv.seq == seq)
+			return RecvResult::Duplicate;
+	recvBuffer.push_back({ seq, server.now(), std::vector<uint8_t>(datagram, datagram + len) });
+	return RecvResult::Buffered;
 }
 
-bool Player::packetAcked(const uint8_t *packet)
+// Buffered datagrams covered by the new sequence number are dropped
+void Player::advanceClientSeq(uint32_t seq)
 {
-	if ((read16(packet, 0) & Packet::FLAG_RUDP) == 0)
+	ackedClientSeq = seq;
+	recvBuffer.erase(std::remove_if(recvBuffer.begin(), recvBuffer.end(), [seq](const RecvDatagram& recv) {
+		return (int32_t)(recv.seq - seq) <= 0;
+	}), recvBuffer.end());
+}
+
+bool Player::takeNextReliable(std::vector<uint8_t>& datagram)
+{
+	for (auto it = recvBuffer.begin(); it != recvBuffer.end(); ++it)
+	{
+		if (it->seq == (uint32_t)ackedClientSeq + 1)
+		{
+			datagram = std::move(it->data);
+			recvBuffer.erase(it);
+			recvReplayPending = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Player::skipReceiveGap(std::vector<uint8_t>& datagram)
+{
+	if (recvBuffer.empty() || recvReplayPending)
 		return false;
-	uint32_t seq = read32(packet, 8);
-	return (int)seq <= ackedClientSeq;
+	auto oldest = std::min_element(recvBuffer.begin(), recvBuffer.end(), [](const RecvDatagram& l, const RecvDatagram& r) {
+		return (int32_t)(l.seq - r.seq) < 0;
+	});
+	if (server.now() - oldest->received < std::max<time_point::duration>(4 * rto, RECV_GAP_MIN))
+		return false;
+	WARN_LOG(server.game, "[%s] RUdp packets %x to %x never received. Skipped", name.c_str(),
+			ackedClientSeq + 1, oldest->seq - 1);
+	ackedClientSeq = oldest->seq - 1;
+	return takeNextReliable(datagram);
+}
+
+bool Player::isFreshGameData(unsigned stream, const uint8_t *packet)
+{
+	if (read16(packet, 0) & Packet::FLAG_RUDP)
+		// offset 8 is the reliable sequence number, and reliable packets are handled in order
+		return true;
+	const uint32_t seq = read32(packet, 8);
+	stream %= GAME_DATA_STREAMS;
+	const uint8_t bit = 1 << stream;
+	if (gameDataSeqValid & bit)
+	{
+		const int32_t diff = (int32_t)(seq - gameDataSeq[stream]);
+		// A large step back means that the client has reset its sequence
+		if (diff < 0 && diff > -1024)
+		{
+			server.staleGameDataDropped();
+			return false;
+		}
+	}
+	gameDataSeq[stream] = seq;
+	gameDataSeqValid |= bit;
+	return true;
+}
+
+#ifdef __linux__
+bool Server::BatchRecv = true;
+#else
+bool Server::BatchRecv = false;
+#endif
+
+Server::Server(uint16_t port, asio::io_context& io_context, bool reusePort)
+	: io_context(io_context),
+	  socket(io_context, asio::ip::udp::v4()),
+	  timerWheel(io_context),
+	  sendQueue(*this, io_context)
+{
+	timerWheel.setHandlerLock(mutex, false);
+#ifdef __linux__
+	if (reusePort)
+		socket.set_option(ReusePort(true));
+#endif
+	socket.bind(asio::ip::udp::endpoint(asio::ip::udp::v4(), port));
+	asio::socket_base::reuse_address option(true);
+	socket.set_option(option);
+#ifdef __linux__
+	if (BatchRecv)
+	{
+		// The first datagram goes into recvbuf, the others are read with recvmmsg
+		constexpr unsigned count = RECV_BATCH - 1;
+		recvRing.resize(count);
+		recvMsgs.resize(count);
+		recvIovecs.resize(count);
+		recvAddrs.resize(count);
+		for (unsigned i = 0; i < count; i++)
+		{
+			recvIovecs[i].iov_base = recvRing[i].data();
+			recvIovecs[i].iov_len = recvRing[i].size();
+			msghdr& hdr = recvMsgs[i].msg_hdr;
+			hdr = {};
+			hdr.msg_name = &recvAddrs[i];
+			hdr.msg_iov = &recvIovecs[i];
+			hdr.msg_iovlen = 1;
+		}
+	}
+#endif
 }
 
 void Server::read()
@@ -172,87 +595,476 @@ void Server::read()
 				read();
 				return;
 			}
-			dump(recvbuf.data(), len);
-			//printf("UdpSocket: received %d bytes to port %d from %s:%d\n", (int)len,
-			//		socket.local_endpoint().port(), source.address().to_string().c_str(), source.port());
-			if (len < 0x14)
-			{
-				ERROR_LOG(Game::None, "datagram too small: %zd bytes", len);
-				read();
-				return;
-			}
-			size_t idx = 0;
-			len -= 4;	// ignore end of datagram tag
-			do {
-				uint16_t pktSize = read16(recvbuf.data(), idx) & 0x3ff;
-				if (pktSize < 0x10) {
-					ERROR_LOG(Game::None, "packet too small: %d bytes", pktSize);
-					break;
-				}
-				// Ack packets have length 0x14 for some reason...
-				if (pktSize > len - idx && recvbuf[idx + 3] != Packet::REQ_NOP) {
-					ERROR_LOG(Game::None, "packet truncated: %d bytes > %zd bytes", pktSize, len - idx);
-					break;
-				}
-				handlePacket(&recvbuf[idx], pktSize);
-				idx += pktSize;
-			} while (idx < len);
-			handlePacketDone();
+			timerWheel.updateTime();
+			dispatchDatagram(recvbuf.data(), len, source);
+			unsigned count = 1 + receiveBatch();
+			recvStats.add(count);
+			flush();
 			read();
 		});
 }
 
-LobbyServer::LobbyServer(Game game, uint16_t port, asio::io_context& io_context)
-	: Server(port, io_context), game(game), timer(io_context)
-
+// Read and handle the datagrams already queued on the socket without going back to the event loop.
+// Returns the number of datagrams handled.
+unsigned Server::receiveBatch()
 {
-	lobbies.reserve(10);
-	addLobby("DCNet");
-	startTimer();
+#ifdef __linux__
+	if (!BatchRecv)
+		return 0;
+	for (mmsghdr& msg : recvMsgs)
+		msg.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+	int count = recvmmsg(socket.native_handle(), recvMsgs.data(), recvMsgs.size(), MSG_DONTWAIT, nullptr);
+	if (count < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			ERROR_LOG(Game::None, "recvmmsg failed: errno %d", errno);
+		return 0;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		const sockaddr_in& addr = recvAddrs[i];
+		source = asio::ip::udp::endpoint(asio::ip::address_v4(ntohl(addr.sin_addr.s_addr)), ntohs(addr.sin_port));
+		if (recvMsgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			ERROR_LOG(Game::None, "datagram truncated: %d bytes", recvMsgs[i].msg_len);
+			continue;
+		}
+		dispatchDatagram(recvRing[i].data(), recvMsgs[i].msg_len, source);
+	}
+	return count;
+#else
+	return 0;
+#endif
 }
 
-void LobbyServer::startTimer()
+void Server::dispatchDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from)
 {
-	timer.expires_after(30s);
-	timer.async_wait([this](const std::error_code& ec) {
-		if (ec)
+	{
+		// Room workers keep running while datagrams are handed over to them
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		if (routeDatagram(data, len, from))
 			return;
-		std::vector<Player *> timeouts;
-		for (auto& [ep, player] : players)
-		{
-			if (player->timedOut()) {
-				INFO_LOG(game, "Player %s has timed out", player->getName().c_str());
-				timeouts.push_back(player);
+	}
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	handleDatagram(data, len, from);
+}
+
+void Server::handleDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from)
+{
+	if (!handleDatagramStart(data, len, from))
+		return;
+	//printf("UdpSocket: received %d bytes to port %d from %s:%d\n", (int)len,
+	//		socket.local_endpoint().port(), source.address().to_string().c_str(), source.port());
+	if (len < 0x14)
+	{
+		ERROR_LOG(Game::None, "datagram too small: %zd bytes", len);
+		return;
+	}
+	size_t idx = 0;
+	len -= 4;	// ignore end of datagram tag
+	try {
+		do {
+			uint16_t pktSize = read16(data, idx) & 0x3ff;
+			if (pktSize < 0x10) {
+				ERROR_LOG(Game::None, "packet too small: %d bytes", pktSize);
+				break;
 			}
-			else if (player->getRoom() == nullptr && player->getLastTimeSeen() + 30s <= Clock::now())
+			// Ack packets have length 0x14 for some reason...
+			if (pktSize > len - idx && data[idx + 3] != Packet::REQ_NOP) {
+				ERROR_LOG(Game::None, "packet truncated: %d bytes > %zd bytes", pktSize, len - idx);
+				break;
+			}
+			handlePacket(&data[idx], pktSize);
+			idx += pktSize;
+		} while (idx < len);
+		handlePacketDone();
+	} catch (const std::exception& e) {
+		// Don't let a bad packet bring down the server
+		ERROR_LOG(getGame(), "Error handling datagram from %s:%d: %s", from.address().to_string().c_str(),
+				from.port(), e.what());
+		handlePacketError();
+	}
+}
+
+Server::SendQueue& Server::getSendQueue()
+{
+	// Rooms running on a worker thread use the worker queue
+	RoomWorker *worker = RoomWorker::current();
+	if (worker != nullptr && &worker->getServer() == this)
+		return worker->getSendQueue();
+	return sendQueue;
+}
+
+uint8_t *Server::SendQueue::queue(size_t len, const asio::ip::udp::endpoint& endpoint, bool gameData)
+{
+	if (!flushPending && !blocked)
+	{
+		// Make sure datagrams queued outside of packet handling or room ticks are sent
+		flushPending = true;
+		asio::post(io_context, [this]() {
+			flush();
+		});
+	}
+	if (datagrams.size() - droppedCount >= MaxDatagrams && !makeRoom(gameData))
+	{
+		stats.dropped++;
+		dropBuffer.resize(len);
+		return dropBuffer.data();
+	}
+	if (droppedCount > MaxDatagrams / 2)
+		compact();
+	size_t offset = data.size();
+	data.resize(offset + len);
+	datagrams.push_back({ endpoint, offset, (uint16_t)len, gameData, false });
+	return &data[offset];
+}
+
+// Drop the oldest lobby datagram, or the oldest game datagram to make room for game data.
+bool Server::SendQueue::makeRoom(bool gameData)
+{
+	OutDatagram *oldestGameData = nullptr;
+	for (OutDatagram& dgram : datagrams)
+	{
+		if (dgram.dropped)
+			continue;
+		if (!dgram.gameData)
+		{
+			dgram.dropped = true;
+			droppedCount++;
+			stats.evicted++;
+			return true;
+		}
+		if (oldestGameData == nullptr)
+			oldestGameData = &dgram;
+	}
+	if (!gameData || oldestGameData == nullptr)
+		return false;
+	oldestGameData->dropped = true;
+	droppedCount++;
+	stats.evicted++;
+	return true;
+}
+
+void Server::SendQueue::compact()
+{
+	size_t offset = 0;
+	size_t j = 0;
+	for (const OutDatagram& dgram : datagrams)
+	{
+		if (dgram.dropped)
+			continue;
+		memmove(&data[offset], &data[dgram.offset], dgram.size);
+		datagrams[j] = dgram;
+		datagrams[j].offset = offset;
+		offset += dgram.size;
+		j++;
+	}
+	datagrams.resize(j);
+	data.resize(offset);
+	droppedCount = 0;
+}
+
+void Server::SendQueue::flush()
+{
+	flushPending = false;
+	if (blocked || datagrams.empty())
+		return;
+	if (droppedCount > 0)
+		compact();
+#ifdef __linux__
+	const size_t count = datagrams.size();
+	if (msgs.size() < count)
+	{
+		msgs.resize(count);
+		iovecs.resize(count);
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		OutDatagram& dgram = datagrams[i];
+		iovecs[i].iov_base = &data[dgram.offset];
+		iovecs[i].iov_len = dgram.size;
+		msghdr& hdr = msgs[i].msg_hdr;
+		hdr = {};
+		hdr.msg_name = dgram.endpoint.data();
+		hdr.msg_namelen = dgram.endpoint.size();
+		hdr.msg_iov = &iovecs[i];
+		hdr.msg_iovlen = 1;
+	}
+	size_t sent = 0;
+	while (sent < count)
+	{
+		int rc = sendmmsg(server.socket.native_handle(), &msgs[sent], std::min<size_t>(count - sent, UIO_MAXIOV), MSG_DONTWAIT);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
 			{
-				// Send a reliable NOP and expect an ack
-				Packet packet;
-				packet.init(Packet::REQ_NOP);
-				packet.flags |= Packet::FLAG_RUDP;
-				player->send(packet);
+				// Keep the remaining datagrams until the socket is writable
+				stats.blocked++;
+				datagrams.erase(datagrams.begin(), datagrams.begin() + sent);
+				waitWritable();
+				return;
 			}
+			// Skip the datagram that failed
+			const asio::ip::udp::endpoint& endpoint = datagrams[sent].endpoint;
+			WARN_LOG(server.getGame(), "send to %s:%d failed: errno %d", endpoint.address().to_string().c_str(), endpoint.port(), errno);
+			sent++;
 		}
-		for (Player *player : timeouts)
-			removePlayer(player);
-		startTimer();
+		else {
+			sent += rc;
+			stats.sent += rc;
+		}
+	}
+#else
+	for (const OutDatagram& dgram : datagrams)
+	{
+		std::error_code ec;
+		server.socket.send_to(asio::buffer(&data[dgram.offset], dgram.size), dgram.endpoint, 0, ec);
+		if (ec)
+			WARN_LOG(server.getGame(), "send to %s:%d failed: %s", dgram.endpoint.address().to_string().c_str(), dgram.endpoint.port(), ec.message().c_str());
+		else
+			stats.sent++;
+	}
+#endif
+	datagrams.clear();
+	data.clear();
+}
+
+void Server::SendQueue::waitWritable()
+{
+#ifdef __linux__
+	// Wait on a duplicate of the socket descriptor so that the handler runs on this queue's thread
+	if (writable == nullptr)
+	{
+		int fd = dup(server.socket.native_handle());
+		if (fd == -1)
+		{
+			ERROR_LOG(server.getGame(), "dup failed: errno %d. Dropping %zd datagrams", errno, datagrams.size());
+			stats.dropped += datagrams.size();
+			datagrams.clear();
+			data.clear();
+			return;
+		}
+		writable = std::make_unique<asio::posix::stream_descriptor>(io_context, fd);
+	}
+	blocked = true;
+	writable->async_wait(asio::posix::stream_descriptor::wait_write, [this](const std::error_code& ec) {
+		blocked = false;
+		if (!ec)
+			flush();
+	});
+#endif
+}
+
+void Server::SendQueue::logStats(const char *name)
+{
+	const uint64_t sent = stats.sent.exchange(0);
+	const uint64_t blocked = stats.blocked.exchange(0);
+	const uint64_t dropped = stats.dropped.exchange(0);
+	const uint64_t evicted = stats.evicted.exchange(0);
+	if (sent == 0 && blocked == 0 && dropped == 0 && evicted == 0)
+		return;
+	INFO_LOG(server.getGame(), "%s: %" PRIu64 " datagrams sent, send buffer full %" PRIu64 " times, %" PRIu64 " dropped, %" PRIu64 " evicted",
+			name, sent, blocked, dropped, evicted);
+}
+
+void Server::logRecvStats(Game game)
+{
+	if (recvStats.wakeups == 0)
+		return;
+	INFO_LOG(game, "recv: %" PRIu64 " datagrams in %" PRIu64 " wakeups (avg %.2f, max %u)",
+			recvStats.datagrams, recvStats.wakeups,
+			(double)recvStats.datagrams / recvStats.wakeups, recvStats.maxBatch);
+	recvStats = {};
+}
+
+unsigned LobbyServer::RecvThreads = 1;
+
+void LobbyServer::logRttStats()
+{
+	if (players.size() == 0)
+		return;
+	// Called with the model lock held exclusively so room workers aren't updating the estimates
+	float srttSum = 0.f, srttMax = 0.f;
+	float rttVarSum = 0.f, rttVarMax = 0.f;
+	std::chrono::milliseconds rtoSum {}, rtoMax {};
+	players.forEach([&](const Player *player) {
+		srttSum += player->getPing();
+		srttMax = std::max(srttMax, player->getPing());
+		rttVarSum += player->getRttVar();
+		rttVarMax = std::max(rttVarMax, player->getRttVar());
+		rtoSum += player->getRto();
+		rtoMax = std::max(rtoMax, player->getRto());
+	});
+	const size_t count = players.size();
+	INFO_LOG(game, "rtt: %zd players, srtt avg %.0f max %.0f ms, rttvar avg %.0f max %.0f ms, rto avg %d max %d ms",
+			count, srttSum / count, srttMax, rttVarSum / count, rttVarMax,
+			(int)(rtoSum.count() / count), (int)rtoMax.count());
+}
+
+LobbyServer::LobbyServer(Game game, uint16_t port, asio::io_context& io_context)
+	: Server(port, io_context, RecvThreads > 1), game(game),
+	  statsTimer(timerWheel, [this]() {
+		for (auto& shard : recvShards)
+			recvStats.add(shard->takeStats());
+		logRecvStats(this->game);
+		logSendStats();
+		logRttStats();
+		for (auto& worker : workers)
+			worker->getSendQueue().logStats("room worker send");
+		if (const uint64_t stale = staleGameData.exchange(0); stale != 0)
+			INFO_LOG(this->game, "%" PRIu64 " late game data packets dropped", stale);
+		statsTimer.expiresAfter(10min);
+	  })
+
+{
+	if (game == Game::PropellerA)
+	{
+		// propeller arena retries after 200 ms, 400 ms, 600 ms, 800 ms then timeout
+		rudpConfig.minRto = 200ms;
+		rudpConfig.backoff = RUdpConfig::Backoff::Linear;
+	}
+	// bba games retry after 100 ms, 200 ms, 400 ms, 800 ms then timeout
+	lobbies.reserve(10);
+	addLobby("DCNet");
+	statsTimer.expiresAfter(10min);
+}
+
+LobbyServer::~LobbyServer()
+{
+	// stop the receive shards and workers before the rooms and players they use
+	recvShards.clear();
+	workers.clear();
+}
+
+void LobbyServer::stop()
+{
+	recvShards.clear();
+	// The workers are kept until the rooms are deleted
+	for (auto& worker : workers)
+		worker->stop();
+}
+
+void LobbyServer::start()
+{
+	Server::start();
+#ifdef __linux__
+	const uint16_t port = socket.local_endpoint().port();
+	for (unsigned i = 1; i < RecvThreads; i++)
+		recvShards.push_back(std::make_unique<RecvShard>(*this, port));
+	if (RecvThreads > 1)
+		INFO_LOG(game, "Receiving on %d sockets", RecvThreads);
+#endif
+}
+
+void LobbyServer::forwardDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from)
+{
+	RoomWorker *worker = nullptr;
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		Player **p = players.find(from);
+		if (p != nullptr && (*p)->getRoom() != nullptr)
+			worker = (*p)->getRoom()->getWorker();
+	}
+	// Ownership is checked again by the receiving thread
+	postDatagram(worker, std::vector<uint8_t>(data, data + len), from);
+}
+
+void LobbyServer::postDatagram(RoomWorker *worker, std::vector<uint8_t>&& datagram, const asio::ip::udp::endpoint& from,
+		bool replay)
+{
+	if (worker != nullptr)
+	{
+		asio::post(worker->getIoContext(), [this, worker, datagram = std::move(datagram), from, replay]() {
+			replayingDatagram = replay;
+			handleWorkerDatagram(*worker, datagram.data(), datagram.size(), from);
+			replayingDatagram = false;
+		});
+	}
+	else
+	{
+		asio::post(io_context, [this, datagram = std::move(datagram), from, replay]() {
+			timerWheel.updateTime();
+			std::unique_lock<std::shared_mutex> lock(mutex);
+			replayingDatagram = replay;
+			handleDatagram(datagram.data(), datagram.size(), from);
+			replayingDatagram = false;
+			lock.unlock();
+			flush();
+		});
+	}
+}
+
+void LobbyServer::setRoomThreads(unsigned count)
+{
+	workers.clear();
+	for (unsigned i = 0; i < count; i++)
+		workers.push_back(std::make_unique<RoomWorker>(*this));
+	if (count > 0)
+		INFO_LOG(game, "Running rooms on %d threads", count);
+}
+
+RoomWorker *LobbyServer::assignRoomWorker()
+{
+	RoomWorker *best = nullptr;
+	for (auto& worker : workers)
+		if (best == nullptr || worker->getRoomCount() < best->getRoomCount())
+			best = worker.get();
+	if (best != nullptr)
+		best->addRoom();
+	return best;
+}
+
+void LobbyServer::createPlayer(const asio::ip::udp::endpoint& endpoint, uint32_t id, const std::string& name)
+{
+	asio::post(io_context, [this, endpoint, id, name]() {
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		Player *player = new Player(*this, endpoint, id, io_context);
+		player->setName(name);
+		// the bootstrap login reply used the first sequence number
+		player->getUnrelSeqAndInc();
+		addPlayer(player);
 	});
 }
 
 void LobbyServer::addPlayer(Player *player)
 {
-	auto it = players.find(player->getEndpoint());
-	if (it != players.end())
+	Player **existing = players.find(player->getEndpoint());
+	if (existing != nullptr)
 	{
 		WARN_LOG(game, "Player %s [%x] from %s:%d already in lobby server",
-				it->second->getName().c_str(), it->second->getId(),
+				(*existing)->getName().c_str(), (*existing)->getId(),
 				player->getEndpoint().address().to_string().c_str(), player->getEndpoint().port());
-		removePlayer(it->second);
+		removePlayer(*existing);
 	}
 	INFO_LOG(game, "Player %s [%x] joined lobby server from %s:%d",
 			player->getName().c_str(), player->getId(),
 			player->getEndpoint().address().to_string().c_str(), player->getEndpoint().port());
-	players[player->getEndpoint()] = player;
+	players.insert(player->getEndpoint(), player);
+	playersById[player->getId()] = player;
+	addName(player);
+}
+
+static inline void strtolower(std::string& str) {
+	std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return std::tolower(c); });
+}
+
+void LobbyServer::addName(Player *player)
+{
+	NameEntry entry{ player->getName(), player };
+	strtolower(entry.key);
+	nameIndex.insert(std::upper_bound(nameIndex.begin(), nameIndex.end(), entry), std::move(entry));
+}
+
+bool LobbyServer::removeName(Player *player)
+{
+	NameEntry entry{ player->getName(), player };
+	strtolower(entry.key);
+	auto it = std::lower_bound(nameIndex.begin(), nameIndex.end(), entry);
+	if (it == nameIndex.end() || it->player != player)
+		return false;
+	nameIndex.erase(it);
+	return true;
 }
 
 void LobbyServer::removePlayer(Player *player)
@@ -260,60 +1072,32 @@ void LobbyServer::removePlayer(Player *player)
 	if (player->getLobby() != nullptr)
 		player->getLobby()->removePlayer(player);
 	players.erase(player->getEndpoint());
+	playersById.erase(player->getId());
+	removeName(player);
 	INFO_LOG(game, "Player %s [%x] left lobby server", player->getName().c_str(), player->getId());
-	status::leave(getDCNetGameId(game), player->getEndpoint().address().to_string(),
+	statusLeave(game, player->getEndpoint().address().to_string(),
 			player->getEndpoint().port(), player->getName());
 	delete player;
 }
 
-void LobbyServer::send(Packet& packet, const asio::ip::udp::endpoint& endpoint)
-{
-	size_t pktsize = packet.finalize();
-	std::error_code ec;
-	socket.send_to(asio::buffer(packet.data, pktsize), endpoint, 0, ec);
-	if (ec)
-		WARN_LOG(game, "send to %s:%d failed: %s", endpoint.address().to_string().c_str(), endpoint.port(), ec.message().c_str());
-}
-
-static inline void strtolower(std::string& str) {
-	std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return std::tolower(c); });
-}
 
 void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 {
-	if (player == nullptr)
+	// player is set by handleDatagramStart()
+	const uint16_t flags = read16(data, 0);
+	if (datagramMode == DatagramMode::ReliableOnly)
 	{
-		auto it = players.find(source);
-		if (it == players.end()) {
-			WARN_LOG(game, "Packet from unknown endpoint %s:%d ignored", source.address().to_string().c_str(), source.port());
+		// Unreliable packets and acks were handled when the datagram was buffered
+		if ((flags & Packet::FLAG_RUDP) == 0)
 			return;
-		}
-		player = it->second;
-		player->setAlive();
 	}
-	// Record if a sent packet is ack'ed
-	const uint16_t flags = read16(data, 0);
-	if (flags & Packet::FLAG_ACK)
-		player->ackRUdp(read32(data, 0xc));
-
-	// Check if we have handled this RUdp packet already
-	if (flags & Packet::FLAG_RUDP)
+	else
 	{
-		if (rudpIgnore)
+		// Record if a sent packet is ack'ed
+		if (flags & Packet::FLAG_ACK)
+			player->ackRUdp(read32(data, 0xc));
+		if (datagramMode == DatagramMode::UnreliableOnly && (flags & Packet::FLAG_RUDP))
 			return;
-		if (!rudpSeen)
-		{
-			rudpSeen = true;
-			if (player->packetAcked(data))
-			{
-				INFO_LOG(game, "[%s] RUdp packet %x already handled. Ignoring", player->getName().c_str(), data[3]);
-				replyPacket.init(Packet::REQ_NOP);
-				uint32_t seq = read32(data, 8);
-				replyPacket.ack(seq);
-				rudpIgnore = true;
-				return;
-			}
-		}
 	}
 
 	// Game-specific packet handling
@@ -328,7 +1112,7 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 			//dumpData(data + 0x10, len - 0x10);
 			player->setName((const char *)&data[0x20]);
 			player->setExtraData(&data[0x138], read32(data, 0x14));
-			status::join(getDCNetGameId(game), player->getEndpoint().address().to_string(),
+			statusJoin(game, player->getEndpoint().address().to_string(),
 					player->getEndpoint().port(), player->getName());
 
 			replyPacket.init(Packet::RSP_LOGIN_SUCCESS2);
@@ -376,59 +1160,31 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 		{
 			replyPacket.init(Packet::REQ_QRY_USERS);
 			player->ackPacket(replyPacket, data);
+			const uint8_t header[8] {};
 			if (data[0] & 0x10)
 			{
 				// lobby
 				replyPacket.flags |= Packet::FLAG_LOBBY;
-				replyPacket.writeData(0u);
-				replyPacket.writeData(0u);
+				ListWriter list(replyPacket, game, player, header, sizeof(header));
 				uint32_t lobbyId = read32(data, 0x10);
 				Lobby *lobby = getLobby(lobbyId);
-				if (lobby == nullptr) {
-					replyPacket.writeData(0u);	// user count
-				}
-				else
-				{
-					replyPacket.writeData(lobby->getPlayerCount());
-					for (Player *pl : lobby->getPlayers())
-					{
-						replyPacket.writeData(pl->getName().c_str(), 0x10);
-						replyPacket.writeData(pl->getId());
-						const auto& extra = pl->getExtraData();
-						replyPacket.writeData((uint32_t)extra.size());
-						replyPacket.writeData(extra.data(), extra.size());
-					}
-				}
+				if (lobby != nullptr)
+					lobby->getRoster().forEach([&list](const uint8_t *entry, size_t size) {
+						list.add(entry, size);
+					});
+				list.finish();
 			}
 			else
 			{
 				// room
-				replyPacket.writeData(0u);
-				replyPacket.writeData(0u);
+				ListWriter list(replyPacket, game, player, header, sizeof(header));
 				int roomId = read32(data, 0x10);
-				if (player->getLobby() == nullptr) {
-					replyPacket.writeData(0u);	// user count
-				}
-				else
-				{
-					Room *room = player->getLobby()->getRoom(roomId);
-					if (room == nullptr) {
-						replyPacket.writeData(0u);	// user count
-					}
-					else
-					{
-						const std::vector<Player *>& players = room->getPlayers();
-						replyPacket.writeData((uint32_t)players.size());
-						for (Player *pl : players)
-						{
-							replyPacket.writeData(pl->getName().c_str(), 0x10);
-							replyPacket.writeData(pl->getId());
-							const auto& extra = pl->getExtraData();
-							replyPacket.writeData((uint32_t)extra.size());
-							replyPacket.writeData(extra.data(), extra.size());
-						}
-					}
-				}
+				Room *room = player->getLobby() == nullptr ? nullptr : player->getLobby()->getRoom(roomId);
+				if (room != nullptr)
+					room->getRoster().forEach([&list](const uint8_t *entry, size_t size) {
+						list.add(entry, size);
+					});
+				list.finish();
 			}
 			break;
 		}
@@ -452,11 +1208,9 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 					// Notify other players
 					relayPacket.init(Packet::REQ_JOIN_LOBBY_ROOM);
 					relayPacket.flags |= Packet::FLAG_LOBBY;
-					relayPacket.writeData(player->getName().c_str(), 0x10);
-					relayPacket.writeData(player->getId());
-					const auto& extra = player->getExtraData();
-					relayPacket.writeData((uint32_t)extra.size());
-					relayPacket.writeData(extra.data(), extra.size());
+					size_t size;
+					if (const uint8_t *entry = lobby->getRoster().getEntry(player, size))
+						relayPacket.writeData(entry, size);
 
 					replyPacket.respOK(Packet::REQ_JOIN_LOBBY_ROOM);
 					replyPacket.writeData(lobby->getId());
@@ -510,11 +1264,9 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 
 				// Notify other players
 				relayPacket.init(Packet::REQ_JOIN_LOBBY_ROOM);
-				relayPacket.writeData(player->getName().c_str(), 0x10);
-				relayPacket.writeData(player->getId());
-				const auto& extra = player->getExtraData();
-				relayPacket.writeData((uint32_t)extra.size());
-				relayPacket.writeData(extra.data(), extra.size());
+				size_t size;
+				if (const uint8_t *entry = room->getRoster().getEntry(player, size))
+					relayPacket.writeData(entry, size);
 
 				replyPacket.respOK(Packet::REQ_JOIN_LOBBY_ROOM);
 				replyPacket.writeData(room->getId());
@@ -572,32 +1324,15 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 			replyPacket.flags |= Packet::FLAG_LOBBY;
 			int lobbyId = read32(data, 0x10);
 			Lobby *lobby = getLobby(lobbyId);
-			replyPacket.writeData(0u);	// ?
-			replyPacket.writeData(0u);	// ?
-			if (lobby == nullptr) {
-				replyPacket.writeData(0u);	// room count
-			}
-			else
+			const uint8_t header[8] {};	// ?
+			ListWriter list(replyPacket, game, player, header, sizeof(header));
+			if (lobby != nullptr)
 			{
-				auto rooms = lobby->getRooms();
-				replyPacket.writeData((uint32_t)rooms.size());
-				for (Room *room : rooms)
-				{
-					replyPacket.writeData(room->getName().c_str(), 0x10);
-					// This is different in outtrigger vs. bomberman
-					if (game == Game::Bomberman) {
-						replyPacket.writeData(room->getOwner()->getId());
-						replyPacket.writeData(room->getPlayerCount());
-					}
-					else {
-						replyPacket.writeData(room->getPlayerCount());
-						replyPacket.writeData(room->getOwner()->getId());
-					}
-					replyPacket.writeData(room->getAttributes());
-					replyPacket.writeData(room->getMaxPlayers());
-					replyPacket.writeData(room->getId());
-				}
+				const std::vector<uint8_t>& roomList = lobby->getRoomList();
+				for (size_t i = 0; i < roomList.size(); i += Lobby::RoomListEntrySize)
+					list.add(&roomList[i], Lobby::RoomListEntrySize);
 			}
+			list.finish();
 			break;
 		}
 	case Packet::REQ_CREATE_ROOM:
@@ -667,6 +1402,7 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 				}
 				// Notify other users
 				relayPacket.init(Packet::REQ_CHG_ROOM_ATTR);
+				relayKey = SharedPacket::key(Packet::REQ_CHG_ROOM_ATTR, read32(data, 0x10), room->getId());
 				relayPacket.writeData(room->getId());
 				relayPacket.writeData(&data[0x10], 4);
 				if (!memcmp(&data[0x10], "NAME", 4))
@@ -730,41 +1466,33 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 			replyPacket.init(Packet::REQ_NOP);
 			player->ackPacket(replyPacket, data);
 
-			const std::vector<Player *> *players = nullptr;
-			if (flags & Packet::FLAG_LOBBY)
-			{
-				const Lobby *lobby = player->getLobby();
-				if (lobby != nullptr)
-					players = &lobby->getPlayers();
-			}
-			else
-			{
-				const Room *room = player->getRoom();
-				if (room != nullptr)
-					players = &room->getPlayers();
-			}
+			// Destination players must be in the sender's lobby or room
+			const Lobby *lobby = (flags & Packet::FLAG_LOBBY) ? player->getLobby() : nullptr;
+			const Room *room = (flags & Packet::FLAG_LOBBY) ? nullptr : player->getRoom();
 			const int destCount = read32(data, 0x10);
 			DEBUG_LOG(game, "[%s] DM_CHAT: %s", player->getName().c_str(), &data[0x10 + (destCount + 1) * 4]);
-			if (players != nullptr)
+			if (lobby == nullptr && room == nullptr)
+				break;
+			SharedPacket::Ptr packet;
+			for (int i = 0; i < destCount; i++)
 			{
-				for (int i = 0; i < destCount; i++)
+				const uint32_t dest = read32(data, 0x14 + i * sizeof(uint32_t));
+				Player *destPlayer = getPlayer(dest);
+				if (destPlayer == nullptr
+						|| (lobby != nullptr && destPlayer->getLobby() != lobby)
+						|| (room != nullptr && destPlayer->getRoom() != room))
+					continue;
+				if (packet == nullptr)
 				{
-					const uint32_t dest = read32(data, 0x14 + i * sizeof(uint32_t));
-					for (Player *destPlayer : *players)
-					{
-						if (destPlayer->getId() == dest)
-						{
-							Packet packet;
-							packet.init(Packet::REQ_DM_CHAT);
-							packet.flags |= Packet::FLAG_RUDP | (flags & Packet::FLAG_LOBBY);
-							packet.relay(player->getId());
-							// message
-							packet.writeData(data + 0x10, len - 0x10);
-							destPlayer->send(packet);
-							break;
-						}
-					}
+					Packet dm;
+					dm.init(Packet::REQ_DM_CHAT);
+					dm.flags |= Packet::FLAG_RUDP | (flags & Packet::FLAG_LOBBY);
+					dm.relay(player->getId());
+					// message
+					dm.writeData(data + 0x10, len - 0x10);
+					packet = SharedPacket::create(dm);
 				}
+				destPlayer->send(packet);
 			}
 			break;
 		}
@@ -787,6 +1515,8 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 		{
 			relayPacket.init(Packet::REQ_CHG_USER_PROP);
 			relayPacket.flags |= Packet::FLAG_RUDP;
+			// only the latest properties matter
+			relayKey = SharedPacket::key(Packet::REQ_CHG_USER_PROP, 0, player->getId());
 			relayPacket.data[2] = data[2];
 			relayPacket.writeData(player->getId());
 			const auto& extra = player->getExtraData();
@@ -861,30 +1591,29 @@ void LobbyServer::handlePacket(const uint8_t *data, size_t len)
 			if (data[0] & 0x10)
 				replyPacket.flags |= Packet::FLAG_LOBBY;
 			player->ackPacket(replyPacket, data);
-			replyPacket.writeData(0u);
-			replyPacket.writeData(0u);
-			uint16_t countOffset = replyPacket.size;
-			replyPacket.writeData(0u); // will get updated
-			int count = 0;
-			for (const auto& [endpoint, pl] : players)
+			const uint8_t header[8] {};
+			ListWriter list(replyPacket, game, player, header, sizeof(header));
+			// name index entries with the given prefix
+			for (auto it = std::lower_bound(nameIndex.begin(), nameIndex.end(), NameEntry{ name, nullptr });
+					it != nameIndex.end() && it->key.compare(0, name.size(), name) == 0;
+					++it)
 			{
+				const Player *pl = it->player;
 				if (pl == player)
 					continue;
-				std::string pname = pl->getName().substr(0, name.size());
-				strtolower(pname);
-				if (pname == name)
-				{
-					replyPacket.writeData(pl->getName().c_str(), 0x10);
-					replyPacket.writeData(pl->getId());
-					replyPacket.writeData(pl->getLobby() != nullptr ? pl->getLobby()->getId() : 0u);
-					replyPacket.writeData(pl->getRoom() != nullptr ? pl->getRoom()->getId() : 0u);
-					const auto& extra = pl->getExtraData();
-					replyPacket.writeData((uint32_t)extra.size());
-					replyPacket.writeData(extra.data(), extra.size());
-					count++;
-				}
+				const auto& extra = pl->getExtraData();
+				uint8_t *entry = list.add(0x20 + extra.size());
+				if (entry == nullptr)
+					continue;
+				strncpy((char *)entry, pl->getName().c_str(), 0x10);
+				write32(entry, 0x10, pl->getId());
+				write32(entry, 0x14, pl->getLobby() != nullptr ? pl->getLobby()->getId() : 0u);
+				write32(entry, 0x18, pl->getRoom() != nullptr ? pl->getRoom()->getId() : 0u);
+				write32(entry, 0x1c, (uint32_t)extra.size());
+				if (!extra.empty())
+					memcpy(entry + 0x20, extra.data(), extra.size());
 			}
-			write32(replyPacket.data, countOffset, count);
+			list.finish();
 			break;
 		}
 
@@ -912,30 +1641,219 @@ void LobbyServer::handlePacketDone()
 			player->send(replyPacket);
 		if (!relayPacket.empty())
 		{
+			// The key only identifies the relay packet if it holds a single chunk.
+			// Other chunks relayed from the same datagram must not be superseded with it.
+			const uint64_t key = relayPacket.startOffset == 0 ? relayKey : 0;
 			if (relayPacket.flags & Packet::FLAG_LOBBY) {
 				if (player->getLobby() != nullptr)
-					Player::sendToAll(relayPacket, player->getLobby()->getPlayers(), player);
+					Player::sendToAll(relayPacket, player->getLobby()->getPlayers(), player, key);
 			}
 			else if (player->getRoom() != nullptr) {
-				Player::sendToAll(relayPacket, player->getRoom()->getPlayers(), player);
+				Player::sendToAll(relayPacket, player->getRoom()->getPlayers(), player, key);
 			}
 		}
 		player = nullptr;
 	}
 	replyPacket.reset();
 	relayPacket.reset();
-	rudpSeen = false;
-	rudpIgnore = false;
+	relayKey = 0;
+	datagramMode = DatagramMode::All;
 }
 
-void LobbyServer::dump(const uint8_t* data, size_t len)
+void LobbyServer::handlePacketError()
 {
-	auto it = players.find(source);
-	if (it == players.end())
-		return;
-	Player *player = it->second;
-	if (player->getRoom() != nullptr)
-		player->getRoom()->writeNetdump(data, len, source);
+	player = nullptr;
+	replyPacket.reset();
+	relayPacket.reset();
+	relayKey = 0;
+	datagramMode = DatagramMode::All;
+}
+
+// Sequence numbers of the first and last reliable packets of a datagram
+static bool findReliableSeq(const uint8_t *data, size_t len, uint32_t& seq, uint32_t& lastSeq)
+{
+	if (len < 0x14)
+		return false;
+	len -= 4;	// end of datagram tag
+	bool found = false;
+	for (size_t idx = 0; idx + 0x10 <= len;)
+	{
+		const uint16_t flags = read16(data, idx);
+		if (flags & Packet::FLAG_RUDP)
+		{
+			const uint32_t s = read32(data, idx + 8);
+			if (!found) {
+				seq = lastSeq = s;
+				found = true;
+			}
+			// Following packets may have no sequence number. Ignore anything that can't follow the first one.
+			else if (s - seq > lastSeq - seq && s - seq < 0x100) {
+				lastSeq = s;
+			}
+		}
+		const uint16_t size = flags & 0x3ff;
+		if (size < 0x10)
+			break;
+		idx += size;
+	}
+	return found;
+}
+
+// Ack the reliable packets of a datagram that isn't handled now
+static void ackReliable(Player *player, const uint8_t *data, size_t len)
+{
+	Packet packet;
+	len -= 4;	// end of datagram tag
+	for (size_t idx = 0; idx + 0x10 <= len;)
+	{
+		const uint16_t flags = read16(data, idx);
+		if (flags & Packet::FLAG_RUDP)
+		{
+			packet.init(Packet::REQ_NOP);
+			player->ackPacket(packet, &data[idx]);
+		}
+		const uint16_t size = flags & 0x3ff;
+		if (size < 0x10)
+			break;
+		idx += size;
+	}
+	if (!packet.empty())
+		player->send(packet);
+}
+
+bool LobbyServer::routeDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from)
+{
+	Player **p = players.find(from);
+	if (p == nullptr || (*p)->getRoom() == nullptr || (*p)->getRoom()->getWorker() == nullptr)
+		return false;
+	// All the datagrams of a player in a room go to the room worker so that they're handled in order
+	postDatagram((*p)->getRoom()->getWorker(), std::vector<uint8_t>(data, data + len), from);
+	return true;
+}
+
+bool LobbyServer::handleDatagramStart(const uint8_t* data, size_t len, const asio::ip::udp::endpoint& from)
+{
+	// Single lookup shared by all the packets of the datagram
+	Player **p = players.find(from);
+	player = p != nullptr ? *p : nullptr;
+	if (player == nullptr) {
+		WARN_LOG(game, "Datagram from unknown endpoint %s:%d ignored", from.address().to_string().c_str(), from.port());
+		return false;
+	}
+	Room *room = player->getRoom();
+	if (room != nullptr && room->getWorker() != nullptr && RoomWorker::current() == nullptr)
+	{
+		// The player has joined a worker room since the datagram was routed, or it's a replayed datagram
+		player = nullptr;
+		postDatagram(room->getWorker(), std::vector<uint8_t>(data, data + len), from, replayingDatagram);
+		return false;
+	}
+	player->setAlive();
+	if (room != nullptr && !replayingDatagram)
+		room->writeNetdump(data, len, from);
+
+	// Reliable packets are handled in order and only once
+	datagramMode = replayingDatagram ? DatagramMode::ReliableOnly : DatagramMode::All;
+	if (!replayingDatagram)
+	{
+		std::vector<uint8_t> next;
+		if (player->skipReceiveGap(next))
+			postDatagram(room != nullptr ? room->getWorker() : nullptr, std::move(next), from, true);
+	}
+	uint32_t seq, lastSeq;
+	if (!findReliableSeq(data, len, seq, lastSeq))
+		return true;
+	const Player::RecvResult result = player->receiveReliable(seq, lastSeq, data, len);
+	if (replayingDatagram && result != Player::RecvResult::InOrder)
+	{
+		// Received again and handled before its replay
+		player = nullptr;
+		return false;
+	}
+	switch (result)
+	{
+	case Player::RecvResult::InOrder:
+		{
+			std::vector<uint8_t> next;
+			if (player->takeNextReliable(next))
+				// handled after this one
+				postDatagram(room != nullptr ? room->getWorker() : nullptr, std::move(next), from, true);
+			return true;
+		}
+	case Player::RecvResult::Duplicate:
+		INFO_LOG(game, "[%s] RUdp packet %x already handled. Ignoring", player->getName().c_str(), seq);
+		[[fallthrough]];
+	case Player::RecvResult::Buffered:
+		// Ack right away so that the client doesn't resend it.
+		// The reliable packets of a buffered datagram are handled when it's replayed.
+		ackReliable(player, data, len);
+		datagramMode = DatagramMode::UnreliableOnly;
+		return true;
+	case Player::RecvResult::Dropped:
+		DEBUG_LOG(game, "[%s] RUdp packet %x too far ahead. Dropped", player->getName().c_str(), seq);
+		datagramMode = DatagramMode::UnreliableOnly;
+		return true;
+	}
+	player = nullptr;
+	return false;
+}
+
+// True if all the packets of the datagram only concern the sender's room
+static bool isRoomTraffic(const uint8_t *data, size_t len)
+{
+	if (len < 0x14)
+		return false;
+	len -= 4;	// end of datagram tag
+	size_t idx = 0;
+	do {
+		const uint16_t flags = read16(data, idx);
+		const uint16_t size = flags & 0x3ff;
+		switch (data[idx + 3])
+		{
+		case Packet::REQ_NOP:
+			break;
+		case Packet::REQ_GAME_DATA:
+		case Packet::REQ_AUDIO_START:
+		case Packet::REQ_AUDIO_STOP:
+		case Packet::REQ_AUDIO:
+			if (size > len - idx)
+				return false;
+			break;
+		case Packet::REQ_CHAT:
+			if (size > len - idx || (flags & Packet::FLAG_LOBBY))
+				return false;
+			break;
+		default:
+			return false;
+		}
+		if (size < 0x10)
+			return false;
+		idx += size;
+	} while (idx < len);
+	return true;
+}
+
+void LobbyServer::handleWorkerDatagram(RoomWorker& worker, const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from)
+{
+	worker.getTimerWheel().updateTime();
+	{
+		// Game data for the rooms of this worker only needs a shared lock
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		Player **p = players.find(from);
+		Room *room = p != nullptr ? (*p)->getRoom() : nullptr;
+		if (room != nullptr && room->getWorker() == &worker && isRoomTraffic(data, len))
+		{
+			handleDatagram(data, len, from);
+			lock.unlock();
+			flush();
+			return;
+		}
+	}
+	// Lobby commands, or the player has left the room in the meantime
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	handleDatagram(data, len, from);
+	lock.unlock();
+	flush();
 }
 
 Room *LobbyServer::addRoom(const std::string& name, uint32_t attributes, Player *owner)
@@ -951,7 +1869,8 @@ bool Room::DumpNetData = false;
 
 Room::Room(Lobby& lobby, uint32_t id, const std::string& name, uint32_t attributes, Player *owner, asio::io_context& io_context)
 	: lobby(lobby), id(id), name(name), attributes(attributes),
-	  owner(owner), server(lobby.getServer()), game(server.game)
+	  owner(owner), server(lobby.getServer()), game(server.game),
+	  worker(server.assignRoomWorker())
 {
 	assert(name.length() <= 16);
 	addPlayer(owner);	// FIXME addPlayer is virtual. can't be called in constructor/destructor
@@ -960,9 +1879,15 @@ Room::Room(Lobby& lobby, uint32_t id, const std::string& name, uint32_t attribut
 
 Room::~Room() {
 	closeNetdump();
+	if (worker != nullptr)
+		worker->removeRoom();
 	INFO_LOG(game, "Room %s was deleted", name.c_str());
 }
 
+TimerWheel& Room::getTimerWheel() const {
+	return worker != nullptr ? worker->getTimerWheel() : server.getTimerWheel();
+}
+
 void Room::addPlayer(Player *player)
 {
 	Room *other = player->getRoom();
@@ -973,7 +1898,9 @@ void Room::addPlayer(Player *player)
 	if (getPlayerIndex(player) >= 0)
 		return;
 	players.push_back(player);
+	roster.add(player);
 	player->setRoom(this);
+	roomListChanged();
 	INFO_LOG(game, "%s joined room %s (ping %d)", player->getName().c_str(), name.c_str(), (int)player->getPing());
 }
 
@@ -989,6 +1916,8 @@ bool Room::removePlayer(Player *player)
 
 	INFO_LOG(game, "%s left room %s", player->getName().c_str(), name.c_str());
 	players.erase(players.begin() + i);
+	roster.remove(player);
+	roomListChanged();
 	if (players.empty())
 		return true;
 
@@ -1007,6 +1936,10 @@ bool Room::removePlayer(Player *player)
 	return false;
 }
 
+void Room::roomListChanged() {
+	lobby.invalidateRoomList();
+}
+
 int Room::getPlayerIndex(const Player *player) const
 {
 	unsigned i = 0;
@@ -1039,7 +1972,8 @@ void Room::openNetdump()
 	if (!DumpNetData)
 			return;
 	time_t now = time(nullptr);
-	struct tm tm = *localtime(&now);
+	struct tm tm;
+	localtime_r(&now, &tm);
 
 	const char *gameId = "";
 	switch (game)
@@ -1092,6 +2026,7 @@ void Lobby::addPlayer(Player *player)
 		if (pl == player)
 			return;
 	players.push_back(player);
+	roster.add(player);
 	INFO_LOG(server.game, "%s joined lobby %s", player->getName().c_str(), name.c_str());
 	// Discord presence
 	std::vector<std::string> names;
@@ -1115,6 +2050,7 @@ void Lobby::removePlayer(Player *player)
 			INFO_LOG(server.game, "%s left lobby %s", player->getName().c_str(), name.c_str());
 			player->setLobby(nullptr);
 			players.erase(it);
+			roster.remove(player);
 			break;
 		}
 	// Notify other players
@@ -1145,6 +2081,7 @@ Room *Lobby::getRoom(uint32_t id) const
 void Lobby::addRoom(Room *room)
 {
 	rooms[room->getId()] = room;
+	roomListDirty = true;
 	// Discord presence
 	std::vector<std::string> lobbyUsers;
 	lobbyUsers.reserve(players.size());
@@ -1153,13 +2090,41 @@ void Lobby::addRoom(Room *room)
 		if (pl != owner)
 			lobbyUsers.push_back(pl->getName());
 	discordGameCreated(server.game, owner->getName(), room->getName(), lobbyUsers);
-	status::createGame(getDCNetGameId(server.game));
+	statusCreateGame(server.game);
 
 }
 
 void Lobby::removeRoom(Room *room)
 {
-	status::deleteGame(getDCNetGameId(server.game));
+	statusDeleteGame(server.game);
 	rooms.erase(room->getId());
+	roomListDirty = true;
 	delete room;
 }
+
+const std::vector<uint8_t>& Lobby::getRoomList()
+{
+	if (!roomListDirty)
+		return roomList;
+	roomList.assign(rooms.size() * RoomListEntrySize, 0);
+	uint8_t *p = roomList.data();
+	for (const auto& [id, room] : rooms)
+	{
+		strncpy((char *)p, room->getName().c_str(), 0x10);
+		// This is different in outtrigger vs. bomberman
+		if (server.game == Game::Bomberman) {
+			write32(p, 0x10, room->getOwner()->getId());
+			write32(p, 0x14, room->getPlayerCount());
+		}
+		else {
+			write32(p, 0x10, room->getPlayerCount());
+			write32(p, 0x14, room->getOwner()->getId());
+		}
+		write32(p, 0x18, room->getAttributes());
+		write32(p, 0x1c, room->getMaxPlayers());
+		write32(p, 0x20, id);
+		p += RoomListEntrySize;
+	}
+	roomListDirty = false;
+	return roomList;
+}
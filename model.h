@@ -18,32 +18,159 @@
 */
 #pragma once
 #include "kage.h"
+#include "timerwheel.h"
+#include "endpointmap.h"
 #include <dcserver/asio.hpp>
 #include <stdint.h>
 #include <string>
 #include <array>
 #include <deque>
+#include <memory>
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <chrono>
+#include <shared_mutex>
+#include <atomic>
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#endif
 
 class Player;
 class Room;
 class Lobby;
 class LobbyServer;
 class Packet;
+class RoomWorker;
+class RecvShard;
 
-using Clock = std::chrono::steady_clock;
-using time_point = std::chrono::time_point<Clock>;
+// Finalized packet data shared by all its recipients.
+// The player id and sequence numbers are patched in when sent to each player.
+class SharedPacket
+{
+public:
+	using Ptr = std::shared_ptr<const SharedPacket>;
 
-class Player
+	// A reliable packet with a non-zero supersede key replaces the queued packet of the same key
+	// that hasn't been sent yet.
+	static Ptr create(Packet& packet, uint64_t supersedeKey = 0);
+	static constexpr uint64_t key(Packet::Command command, uint32_t subtype, uint32_t id) {
+		return ((uint64_t)command << 56) ^ ((uint64_t)(subtype & 0xffffff) << 32) ^ id;
+	}
+
+	size_t getSize() const {
+		return data.size();
+	}
+	Packet::Command getCommand() const {
+		return (Packet::Command)data[3];
+	}
+	bool isReliable() const {
+		return reliable;
+	}
+	// Number of unreliable sequence numbers used by the packet
+	unsigned getUnrelSeqCount() const {
+		return unrelSeqCount;
+	}
+	uint64_t getSupersedeKey() const {
+		return supersedeKey;
+	}
+
+	// Copy the packet data to dest and set the player id and sequence numbers
+	void writeTo(uint8_t *dest, uint32_t playerId, uint32_t relSeq, uint32_t unrelSeq) const;
+
+private:
+	struct Patch
+	{
+		enum Field : uint16_t { PlayerId, RelSeq, UnrelSeq };
+		uint16_t offset;
+		Field field;
+	};
+	std::vector<uint8_t> data;
+	std::vector<Patch> patches;
+	bool reliable = false;
+	unsigned unrelSeqCount = 0;
+	uint64_t supersedeKey = 0;
+};
+
+// Packed list of players as sent in REQ_QRY_USERS replies and join relays.
+// Each entry has the player name (16 bytes), id, extra data size and extra data.
+class Roster
 {
 public:
-	Player(LobbyServer& server, const asio::ip::udp::endpoint& endpoint, uint32_t id, asio::io_context& io_context)
-		: server(server), id(id), endpoint(endpoint), timer(io_context)
+	void add(const Player *player);
+	void remove(const Player *player);
+	// Rewrite the entry of a player after a name or extra data change
+	void update(const Player *player);
+
+	uint32_t getCount() const {
+		return (uint32_t)entries.size();
+	}
+	// All the entries
+	const std::vector<uint8_t>& getData() const {
+		return data;
+	}
+	// Returns the entry of the given player, or nullptr if not found
+	const uint8_t *getEntry(const Player *player, size_t& size) const;
+	// Call f(entry, size) for each entry
+	template<typename F>
+	void forEach(F f) const
+	{
+		for (const Entry& entry : entries)
+			f(&data[entry.offset], (size_t)entry.size);
+	}
+
+private:
+	struct Entry
 	{
-		setAlive();
+		const Player *player;
+		uint32_t offset;
+		uint32_t size;
+	};
+	int find(const Player *player) const;
+	void write(const Player *player, uint8_t *p);
+	static uint32_t entrySize(const Player *player);
+
+	std::vector<uint8_t> data;
+	std::vector<Entry> entries;
+};
+
+// Writes a list of entries in a reply chunk: the list header, the number of entries, then the entries.
+// There is no evidence that clients add up the entry counts of several chunks, so the list is truncated
+// to what fits in one chunk of a single datagram.
+class ListWriter
+{
+public:
+	// The packet chunk must be initialized and acked
+	ListWriter(Packet& packet, Game game, const Player *player, const uint8_t *header, size_t headerSize);
+
+	// Returns a pointer to the next entry to fill in, or nullptr if the list is full
+	uint8_t *add(size_t size);
+	void add(const uint8_t *entry, size_t size) {
+		uint8_t *p = add(size);
+		if (p != nullptr)
+			memcpy(p, entry, size);
 	}
-	~Player();
+	// Write the entry count and log the entries left out
+	void finish();
+
+	// Ethernet MTU minus IP and UDP headers
+	static constexpr size_t MaxDatagramSize = 1472;
+
+private:
+	Packet& packet;
+	Game game;
+	const Player *player;
+	uint16_t countOffset = 0;
+	uint32_t count = 0;
+	uint32_t truncated = 0;
+};
+
+class Player
+{
+public:
+	Player(LobbyServer& server, const asio::ip::udp::endpoint& endpoint, uint32_t id, asio::io_context& io_context);
 
 	uint32_t getId() const {
 		return id;
@@ -52,9 +179,7 @@ public:
 	const std::string& getName() const {
 		return name;
 	}
-	void setName(const std::string& name) {
-		this->name = name;
-	}
+	void setName(const std::string& name);
 	const asio::ip::udp::endpoint& getEndpoint() const {
 		return endpoint;
 	}
@@ -62,12 +187,7 @@ public:
 	const std::vector<uint8_t>& getExtraData() const {
 		return extraData;
 	}
-	void setExtraData(const uint8_t *data, unsigned size)
-	{
-		extraData.resize(size);
-		if (size != 0)
-			memcpy(extraData.data(), data, size);
-	}
+	void setExtraData(const uint8_t *data, unsigned size);
 
 	void setStatus(uint32_t status) {
 		this->status = status;
@@ -87,8 +207,12 @@ public:
 		this->room = room;
 	}
 
-	void send(Packet& packet);
-	static void sendToAll(Packet& packet, const std::vector<Player *>& players, Player *except = nullptr);
+	void send(Packet& packet, uint64_t supersedeKey = 0) {
+		send(SharedPacket::create(packet, supersedeKey));
+	}
+	void send(const SharedPacket::Ptr& packet);
+	static void sendToAll(Packet& packet, const std::vector<Player *>& players, Player *except = nullptr,
+			uint64_t supersedeKey = 0);
 
 	uint32_t getUnrelSeqAndInc() {
 		return unrelSeq++;
@@ -100,7 +224,19 @@ public:
 	void ackRUdp(uint32_t seq);
 
 	void ackPacket(Packet& outPacket, const uint8_t *inPacket);
-	bool packetAcked(const uint8_t *packet);
+
+	enum class RecvResult { InOrder, Buffered, Duplicate, Dropped };
+	// Sequence a received datagram holding reliable packets numbered from seq to lastSeq.
+	// Datagrams received ahead of the next expected sequence number are buffered.
+	RecvResult receiveReliable(uint32_t seq, uint32_t lastSeq, const uint8_t *datagram, size_t len);
+	// Take the buffered datagram that is next in sequence, if any
+	bool takeNextReliable(std::vector<uint8_t>& datagram);
+	// Give up on the missing reliable packets once the oldest buffered datagram has waited too long.
+	// Returns the oldest buffered datagram, which is next in sequence then.
+	bool skipReceiveGap(std::vector<uint8_t>& datagram);
+	// Returns false if an unreliable game data packet is older than the last one received
+	// on the same stream. Games use one stream per plane slot or per game data command.
+	bool isFreshGameData(unsigned stream, const uint8_t *packet);
 
 	void setAlive();
 	bool timedOut() const;
@@ -109,13 +245,38 @@ public:
 		return lastTime;
 	}
 
+	// Smoothed round-trip time in ms
 	float getPing() const {
-		return ping;
+		return srtt;
+	}
+	// Round-trip time variation in ms
+	float getRttVar() const {
+		return rttVar;
+	}
+	// Current retransmission timeout
+	std::chrono::milliseconds getRto() const {
+		return rto;
 	}
 
 private:
-	void sendRel(Packet& packet, uint32_t seq);
-	void resendTimer(const std::error_code& ec);
+	struct RelPacket
+	{
+		SharedPacket::Ptr packet;
+		uint32_t seq;
+		uint32_t unrelSeq;
+		int sendCount = 0;
+		time_point lastSend;
+		time_point deadline;
+	};
+	void supersede(uint64_t key);
+	void fillRelWindow();
+	void transmit(RelPacket& packet);
+	void updateRtt(std::chrono::steady_clock::duration sample);
+	void advanceClientSeq(uint32_t seq);
+	bool isDuplicateAck() const;
+	void startResendTimer();
+	void onResendTimer();
+	void onIdleTimer();
 
 	LobbyServer& server;
 	uint32_t id = 0;
@@ -131,13 +292,39 @@ private:
 	uint32_t unrelSeq = 0;
 	int waitingForSeq = -1;
 	time_point lastTime;
-	Packet lastRelPacket;
-	std::deque<std::pair<uint32_t, Packet>> relQueue;
-	asio::steady_timer timer;
-	int sendCount = 0;
-	float ping = 100.f;
-	time_point lastRUdpSend;
+	// Unacked reliable packets. The first relInFlight ones have been sent.
+	std::deque<RelPacket> relQueue;
+	unsigned relInFlight = 0;
+	int dupAckCount = 0;
+	// Too many unacked packets. The player is being dropped.
+	bool relOverflow = false;
+	WheelTimer resendTimer;
+	// Checks for time outs and sends keep-alives
+	WheelTimer idleTimer;
+	// RTT estimates (RFC 6298)
+	float srtt = 100.f;
+	float rttVar = 50.f;
+	bool rttSampled = false;
+	std::chrono::milliseconds rto { 300 };
+	// Last client reliable sequence number handled in order
 	int ackedClientSeq = -1;
+	// Max distance of a buffered datagram from the last in-order sequence number
+	static constexpr uint32_t RECV_WINDOW = 16;
+	// Min wait for a missing reliable packet. Clients give up after retrying for 2 s.
+	static constexpr std::chrono::milliseconds RECV_GAP_MIN { 2000 };
+	struct RecvDatagram
+	{
+		uint32_t seq;
+		time_point received;
+		std::vector<uint8_t> data;
+	};
+	std::vector<RecvDatagram> recvBuffer;
+	// The buffered datagram next in sequence has been taken and is about to be handled
+	bool recvReplayPending = false;
+	// Last unreliable sequence number received on each game data stream
+	static constexpr unsigned GAME_DATA_STREAMS = 8;
+	std::array<uint32_t, GAME_DATA_STREAMS> gameDataSeq {};
+	uint8_t gameDataSeqValid = 0;
 };
 
 class Room
@@ -162,6 +349,7 @@ public:
 	}
 	void setName(const std::string& name) {
 		this->name = name;
+		roomListChanged();
 	}
 
 	Player *getOwner() const {
@@ -173,6 +361,7 @@ public:
 	}
 	virtual void setAttributes(uint32_t attributes) {
 		this->attributes = attributes;
+		roomListChanged();
 	}
 
 	uint32_t getMaxPlayers() const {
@@ -180,6 +369,7 @@ public:
 	}
 	void setMaxPlayers(uint32_t maxPlayers) {
 		this->maxPlayers = maxPlayers;
+		roomListChanged();
 	}
 
 	const std::string& getPassword() const {
@@ -200,6 +390,19 @@ public:
 	const std::vector<Player *>& getPlayers() const {
 		return players;
 	}
+	const Roster& getRoster() const {
+		return roster;
+	}
+	void updateRoster(const Player *player) {
+		roster.update(player);
+	}
+
+	// Worker thread running this room, or nullptr if the room runs on the server thread
+	RoomWorker *getWorker() const {
+		return worker;
+	}
+	// Timer wheel of the thread running this room
+	TimerWheel& getTimerWheel() const;
 
 	virtual void rudpAcked(Player *player) {
 	}
@@ -212,6 +415,8 @@ protected:
 	virtual void onRemovePlayer(Player *player, int index) {
 	}
 
+	// Invalidate the lobby room list
+	void roomListChanged();
 	void openNetdump();
 	void closeNetdump() {
 		if (netdump != nullptr)
@@ -226,8 +431,10 @@ protected:
 	uint32_t maxPlayers = 0;
 	std::string password;
 	std::vector<Player *> players;
+	Roster roster;
 	LobbyServer& server;
 	const Game game;
+	RoomWorker *const worker;
 	FILE *netdump = nullptr;
 };
 
@@ -259,6 +466,12 @@ public:
 	const std::vector<Player *>& getPlayers() const {
 		return players;
 	}
+	const Roster& getRoster() const {
+		return roster;
+	}
+	void updateRoster(const Player *player) {
+		roster.update(player);
+	}
 
 	uint32_t getRoomCount() const {
 		return (uint32_t)rooms.size();
@@ -268,12 +481,22 @@ public:
 	void addRoom(Room *room);
 	void removeRoom(Room *room);
 
+	// Serialized room list for REQ_QRY_ROOMS, RoomListEntrySize bytes per room
+	const std::vector<uint8_t>& getRoomList();
+	static constexpr size_t RoomListEntrySize = 0x10 + 5 * sizeof(uint32_t);
+	void invalidateRoomList() {
+		roomListDirty = true;
+	}
+
 private:
 	LobbyServer& server;
 	const uint32_t id;
 	std::string name;
 	std::vector<Player *> players;
+	Roster roster;
 	std::map<uint32_t, Room *> rooms;
+	std::vector<uint8_t> roomList;
+	bool roomListDirty = true;
 };
 
 class Server
@@ -281,39 +504,230 @@ class Server
 public:
 	virtual ~Server() {}
 
-	Server(uint16_t port, asio::io_context& io_context)
-		: io_context(io_context),
-		  socket(io_context, asio::ip::udp::endpoint(asio::ip::udp::v4(), port))
-	{
-		asio::socket_base::reuse_address option(true);
-		socket.set_option(option);
-	}
+	// With reusePort, other sockets can be bound to the same port to share the incoming traffic
+	Server(uint16_t port, asio::io_context& io_context, bool reusePort = false);
 
-	void start() {
+	virtual void start() {
 		read();
 	}
 
+	// Datagrams queued by one thread and sent together.
+	// When the socket send buffer is full, the remaining datagrams are kept until the socket is writable.
+	// The queue is bounded: lobby datagrams are dropped first to make room for game data.
+	class SendQueue
+	{
+	public:
+		SendQueue(Server& server, asio::io_context& io_context)
+			: server(server), io_context(io_context) {
+		}
+
+		uint8_t *queue(size_t len, const asio::ip::udp::endpoint& endpoint, bool gameData);
+		void flush();
+		void logStats(const char *name);
+
+		// Max number of datagrams waiting for the socket to be writable
+		static constexpr size_t MaxDatagrams = 4096;
+
+	private:
+		struct OutDatagram
+		{
+			asio::ip::udp::endpoint endpoint;
+			size_t offset;
+			uint16_t size;
+			bool gameData;
+			bool dropped;
+		};
+		bool makeRoom(bool gameData);
+		void compact();
+		void waitWritable();
+
+		Server& server;
+		asio::io_context& io_context;
+		std::vector<uint8_t> data;
+		std::vector<OutDatagram> datagrams;
+		size_t droppedCount = 0;
+		bool flushPending = false;
+		// Waiting for the socket to be writable
+		bool blocked = false;
+		std::vector<uint8_t> dropBuffer;
+#ifdef __linux__
+		std::vector<mmsghdr> msgs;
+		std::vector<iovec> iovecs;
+		std::unique_ptr<asio::posix::stream_descriptor> writable;
+#endif
+		struct {
+			std::atomic<uint64_t> sent { 0 };
+			std::atomic<uint64_t> blocked { 0 };	// send buffer full
+			std::atomic<uint64_t> dropped { 0 };	// new datagram dropped
+			std::atomic<uint64_t> evicted { 0 };	// queued datagram dropped for a newer one
+		} stats;
+	};
+
+	// Queue a datagram to be sent at the end of the current handler or tick.
+	// Game data is kept over other datagrams if the send queue is full.
+	// Returns a pointer to the datagram data to fill in, valid until the next call.
+	uint8_t *queueDatagram(size_t len, const asio::ip::udp::endpoint& endpoint, bool gameData = false) {
+		return getSendQueue().queue(len, endpoint, gameData);
+	}
+	void sendDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& endpoint) {
+		memcpy(queueDatagram(len, endpoint), data, len);
+	}
+	// Send all the datagrams queued by the calling thread
+	void flush() {
+		getSendQueue().flush();
+	}
+
+	// Receive up to RECV_BATCH datagrams per wakeup (linux only)
+	static bool BatchRecv;
+	static constexpr unsigned RECV_BATCH = 32;
+	using RecvBuffer = std::array<uint8_t, 1510>;
+	struct RecvStats
+	{
+		uint64_t wakeups = 0;
+		uint64_t datagrams = 0;
+		unsigned maxBatch = 0;
+
+		void add(unsigned count) {
+			wakeups++;
+			datagrams += count;
+			maxBatch = std::max(maxBatch, count);
+		}
+		void add(const RecvStats& other) {
+			wakeups += other.wakeups;
+			datagrams += other.datagrams;
+			maxBatch = std::max(maxBatch, other.maxBatch);
+		}
+	};
+#ifdef __linux__
+	using ReusePort = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+	asio::io_context& getIoContext() {
+		return io_context;
+	}
+	TimerWheel& getTimerWheel() {
+		return timerWheel;
+	}
+	// Time at the beginning of the current event handler
+	time_point now() const {
+		return timerWheel.now();
+	}
+	// Held exclusively by the server thread while handling datagrams and timers, and shared while routing datagrams.
+	// Room workers hold it shared while running their rooms.
+	std::shared_mutex& getMutex() {
+		return mutex;
+	}
+
 protected:
 	void read();
+	void handleDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from);
+	void logRecvStats(Game game);
+	void logSendStats() {
+		sendQueue.logStats("send");
+	}
 	// Called for each packet in the datagram
 	virtual void handlePacket(const uint8_t *data, size_t len) = 0;
 	// Called after all packets have been handled
 	virtual void handlePacketDone() {
 	}
-	// Hook to dump all UDP data received
-	virtual void dump(const uint8_t* data, size_t len) {
+	// Called instead of handlePacketDone() if packet handling failed
+	virtual void handlePacketError() {
+	}
+	// Called with the model lock held shared when a datagram is received on the server thread.
+	// Returns true if the datagram has been handed over to another thread.
+	virtual bool routeDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from) {
+		return false;
+	}
+	// Called when a datagram is received, before its packets are handled.
+	// Returns false if the datagram must not be handled further.
+	virtual bool handleDatagramStart(const uint8_t* data, size_t len, const asio::ip::udp::endpoint& from) {
+		return true;
 	}
 
 	asio::io_context& io_context;
 	asio::ip::udp::socket socket;
-	std::array<uint8_t, 1510> recvbuf;
+	std::shared_mutex mutex;
+	TimerWheel timerWheel;
+	RecvBuffer recvbuf;
 	asio::ip::udp::endpoint source;	// source endpoint when receiving packets
+	RecvStats recvStats;
+
+	virtual Game getGame() const {
+		return Game::None;
+	}
+
+private:
+	// Route the datagram or handle it with the model lock held exclusively
+	void dispatchDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from);
+	unsigned receiveBatch();
+	// Send queue of the calling thread
+	SendQueue& getSendQueue();
+
+	SendQueue sendQueue;
+#ifdef __linux__
+	// Additional datagrams read with recvmmsg after recvbuf
+	std::vector<RecvBuffer> recvRing;
+	std::vector<mmsghdr> recvMsgs;
+	std::vector<iovec> recvIovecs;
+	std::vector<sockaddr_in> recvAddrs;
+#endif
 };
 
 class LobbyServer : public Server
 {
 public:
 	LobbyServer(Game game, uint16_t port, asio::io_context& io_context);
+	~LobbyServer() override;
+
+	void start() override;
+	// Stop the receive shards and room workers. Called before the services used by the rooms are destroyed.
+	void stop();
+	// Number of sockets receiving the traffic of each lobby server (linux only).
+	// The additional sockets use SO_REUSEPORT and each have their own thread.
+	static unsigned RecvThreads;
+	// Hand a datagram received by a receive shard over to the thread owning the player.
+	// Lobby datagrams are still parsed by the server thread, only room traffic is spread over threads.
+	void forwardDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from);
+	// Queue a datagram on the worker running the player's room or on the server thread.
+	// The unreliable packets and acks of a replayed datagram have already been handled.
+	void postDatagram(RoomWorker *worker, std::vector<uint8_t>&& datagram, const asio::ip::udp::endpoint& from,
+			bool replay = false);
+
+	// Reliable UDP settings
+	struct RUdpConfig
+	{
+		// Max number of unacked reliable packets per player.
+		// Use 1 for stop-and-wait if the game client can't cope with more.
+		unsigned window = 4;
+		// Retransmission timeout bounds
+		std::chrono::milliseconds minRto { 100 };
+		std::chrono::milliseconds maxRto { 2000 };
+		// How the timeout grows with each retransmission
+		enum class Backoff { Exponential, Linear };
+		Backoff backoff = Backoff::Exponential;
+		// Number of transmissions before giving up
+		int maxAttempts = 4;
+		// Max number of queued reliable packets per player before the player is dropped
+		unsigned maxQueue = 256;
+	};
+	const RUdpConfig& getRUdpConfig() const {
+		return rudpConfig;
+	}
+	void setRUdpConfig(const RUdpConfig& config)
+	{
+		rudpConfig = config;
+		if (rudpConfig.window == 0)
+			rudpConfig.window = 1;
+		if (rudpConfig.maxAttempts < 1)
+			rudpConfig.maxAttempts = 1;
+		rudpConfig.maxQueue = std::max(rudpConfig.maxQueue, rudpConfig.window);
+		rudpConfig.maxRto = std::max(rudpConfig.minRto, rudpConfig.maxRto);
+	}
+
+	// A late unreliable game data packet has been dropped
+	void staleGameDataDropped() {
+		staleGameData++;
+	}
 
 	void addLobby(const std::string& name)
 	{
@@ -329,34 +743,77 @@ public:
 		return &lobbies[id];
 	}
 
+	// Create a player that logged in through the bootstrap server. Can be called from any thread.
+	void createPlayer(const asio::ip::udp::endpoint& endpoint, uint32_t id, const std::string& name);
 	void addPlayer(Player *player);
 	void removePlayer(Player *player);
-	void send(Packet& packet, const asio::ip::udp::endpoint& endpoint);
+	Player *getPlayer(uint32_t id) const
+	{
+		auto it = playersById.find(id);
+		return it == playersById.end() ? nullptr : it->second;
+	}
+	// Add/remove a player to/from the name index. removeName returns false if not indexed.
+	void addName(Player *player);
+	bool removeName(Player *player);
 	virtual Room *addRoom(const std::string& name, uint32_t attributes, Player *owner);
 
+	// Run the game rooms on count worker threads instead of the server thread. Must be called before start().
+	void setRoomThreads(unsigned count);
+	// Returns the worker that will run a new room, or nullptr
+	RoomWorker *assignRoomWorker();
+
 	const Game game;
 
 protected:
-	void dump(const uint8_t* data, size_t len) override;
+	Game getGame() const override {
+		return game;
+	}
+	bool routeDatagram(const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from) override;
+	bool handleDatagramStart(const uint8_t* data, size_t len, const asio::ip::udp::endpoint& from) override;
 	void handlePacket(const uint8_t *data, size_t len) override;
 	void handlePacketDone() override;
+	void handlePacketError() override;
 	// Game-specific packet handling called before normal handling to be overridden by subclasses.
 	// Returns true if the packet was handled.
 	virtual bool handlePacket(Player *player, const uint8_t *data, size_t len) {
 		return false;
 	}
-	void startTimer();
+	// Handle a datagram routed to a room worker
+	void handleWorkerDatagram(RoomWorker& worker, const uint8_t *data, size_t len, const asio::ip::udp::endpoint& from);
+	// Log the RTT estimates of the connected players
+	void logRttStats();
 
 	std::vector<Lobby> lobbies;
 	uint32_t nextRoomId = 0x2001;
-	using PlayerMap = std::map<asio::ip::udp::endpoint, Player *>;
-	PlayerMap players;
-	asio::steady_timer timer;
-	// Current player and packets during packet handling
-	Player *player = nullptr;
-	Packet replyPacket;
-	Packet relayPacket;
-	bool rudpSeen = false;
-	bool rudpIgnore = false;
+	EndpointMap<Player *> players;
+	std::unordered_map<uint32_t, Player *> playersById;
+	// Players sorted by lowercase name
+	struct NameEntry
+	{
+		std::string key;
+		Player *player;
+
+		bool operator<(const NameEntry& other) const {
+			int c = key.compare(other.key);
+			return c < 0 || (c == 0 && std::less<Player *>()(player, other.player));
+		}
+	};
+	std::vector<NameEntry> nameIndex;
+	WheelTimer statsTimer;
+	RUdpConfig rudpConfig;
+	std::vector<std::unique_ptr<RoomWorker>> workers;
+	std::vector<std::unique_ptr<RecvShard>> recvShards;
+	// Current player and packets during packet handling. Room workers handle datagrams concurrently.
+	static inline thread_local Player *player = nullptr;
+	static inline thread_local Packet replyPacket;
+	static inline thread_local Packet relayPacket;
+	// Which packets of the current datagram are handled
+	enum class DatagramMode { All, UnreliableOnly, ReliableOnly };
+	static inline thread_local DatagramMode datagramMode = DatagramMode::All;
+	// Set while a buffered reliable datagram is handled
+	static inline thread_local bool replayingDatagram = false;
+	// Supersede key of the last relayed chunk. Only used if the relay packet has no other chunk.
+	static inline thread_local uint64_t relayKey = 0;
 	static constexpr uint32_t LOBBY_ID_BASE = 0x3001;
+	std::atomic<uint64_t> staleGameData { 0 };
 };
@@ -147,7 +147,7 @@ bool OuttriggerServer::handlePacket(Player *player, const uint8_t *data, size_t
 				player->ackPacket(replyPacket, data);
 			}
 			OTRoom *room = (OTRoom *)player->getRoom();
-			if (room != nullptr)
+			if (room != nullptr && player->isFreshGameData(0, data))
 				room->setGameData(player, &data[0x12]);
 			break;
 		}
@@ -224,20 +224,9 @@ void OTRoom::setAttributes(uint32_t attributes)
 		// Start the time limit timer when the owner unlocks the room
 		// time limit at offset 0xd in owner's sysdata
 		int limit = TimeLimits[playerState[0].sysdata[0xd] & 0xf];
-		std::error_code ec;
-		timeLimit.cancel(ec);
+		timeLimit.cancel();
 		if (limit > 0)
-		{
-			timeLimit.expires_after(std::chrono::seconds(limit));
-			timeLimit.async_wait([this](const std::error_code& ec)
-			{
-				if (ec)
-					return;
-				// Send game_over to all players
-				INFO_LOG(server.game, "%s: time limit reached", name.c_str());
-				sendGameOver();
-			});
-		}
+			timeLimit.expiresAfter(std::chrono::seconds(limit));
 		// match points at offset 3, point limit flag at offset 2 bit 4
 		if (playerState[0].sysdata[2] & 0x10)
 			pointLimit = (playerState[0].sysdata[3] >> 2) & 0x3f;
@@ -346,7 +335,7 @@ void OTRoom::setGameData(const Player *player, const uint8_t *data)
 	PlayerState& state = getPlayerState(i);
 	memcpy(state.gamedata.data(), data, state.gamedata.size());
 	if (roomState == SyncStarted)
-		sendGameData({});
+		sendGameData();
 	// 114 seems to be the max score you can have in game.
 	// However the correct score is displayed on the result screen.
 	if (pointLimit > 0 && data[8] <= 0xf6)
@@ -361,27 +350,31 @@ void OTRoom::setGameData(const Player *player, const uint8_t *data)
 	}
 }
 
-void OTRoom::sendGameData(const std::error_code& ec)
+void OTRoom::onTimeLimit()
 {
-	if (ec)
-		return;
+	// Send game_over to all players
+	INFO_LOG(server.game, "%s: time limit reached", name.c_str());
+	sendGameOver();
+}
 
+void OTRoom::sendGameData()
+{
 	Packet packet;
 	packet.init(Packet::REQ_CHAT);
 	packet.writeData(getNextFrame());
 	for (const PlayerState& state : playerState)
 		packet.writeData(state.gamedata.data(), state.gamedata.size());
 	Player::sendToAll(packet, players);
+	server.flush();
 
 	// send game data every 66.667 ms (4 frames) like the game does
 	if (roomState == SyncStarted) {
-		timer.expires_after(66667us);
+		timer.expiresAfter(66667us);
 		roomState = InGame;
 	}
 	else {
-		timer.expires_at(timer.expiry() + 66667us);
+		timer.expiresAt(timer.expiry() + 66667us);
 	}
-	timer.async_wait(std::bind(&OTRoom::sendGameData, this, asio::placeholders::error));
 }
 
 void OTRoom::sendGameOver()
@@ -427,9 +420,8 @@ void OTRoom::reset()
 		state.state = PlayerState::Init;
 	frameNum = 0;
 	roomState = Init;
-	std::error_code ec;
-	timer.cancel(ec);
-	timeLimit.cancel(ec);
+	timer.cancel();
+	timeLimit.cancel();
 }
 
 void OTRoom::startSync()
@@ -441,9 +433,8 @@ void OTRoom::startSync()
 
 void OTRoom::endGame()
 {
-	std::error_code ec;
-	timer.cancel(ec);
-	timeLimit.cancel(ec);
+	timer.cancel();
+	timeLimit.cancel();
 	roomState = Result;
 }
 
@@ -62,7 +62,9 @@ class OTRoom : public Room
 {
 public:
 	OTRoom(Lobby& lobby, uint32_t id, const std::string& name, uint32_t attributes, Player *owner, asio::io_context& io_context)
-		: Room(lobby, id, name, attributes, owner, io_context), timer(io_context), timeLimit(io_context)
+		: Room(lobby, id, name, attributes, owner, io_context),
+		  timer(getTimerWheel(), [this]() { sendGameData(); }),
+		  timeLimit(getTimerWheel(), [this]() { onTimeLimit(); })
 	{}
 
 	void setAttributes(uint32_t attributes) override;
@@ -107,15 +109,16 @@ private:
 	};
 
 	void onRemovePlayer(Player *player, int index) override;
-	void sendGameData(const std::error_code& ec);
+	void sendGameData();
+	void onTimeLimit();
 	PlayerState& getPlayerState(unsigned index);
 	void sendGameOver();
 
 	uint16_t frameNum = 0;
 	enum { Init, SyncStarted, InGame, GameOver, Result } roomState = Init;
 	std::vector<PlayerState> playerState;
-	asio::steady_timer timer;
-	asio::steady_timer timeLimit;
+	WheelTimer timer;
+	WheelTimer timeLimit;
 	int pointLimit = 0;
 };
 
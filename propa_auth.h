@@ -19,12 +19,15 @@
 #pragma once
 #include "kage.h"
 #include "log.h"
-#include <dcserver/shared_this.hpp>
+#include "tcpsession.h"
 #include <dcserver/asio.hpp>
 extern "C" {
 #include "blowfish.h"
 }
 #include <array>
+#include <atomic>
+#include <cinttypes>
+#include <memory>
 #include <string>
 #include <vector>
 using namespace std::chrono_literals;
@@ -38,95 +41,104 @@ static inline void xor55(uint8_t *data, size_t len)
 		*data++ ^= 0x55;
 }
 
-class AuthConnection : public SharedThis<AuthConnection>
+// Runs the Blowfish key schedules and bulk decryption of auth messages off the auth io_context
+class CryptoPool
 {
 public:
-	asio::ip::tcp::socket& getSocket() {
-		return socket;
+	// With 0 threads, jobs run on the calling thread
+	CryptoPool(unsigned threads)
+	{
+		if (threads > 0)
+			pool = std::make_unique<asio::thread_pool>(threads);
+	}
+
+	// Run the job on a pool thread, then resume on the calling coroutine's executor
+	template<typename F>
+	asio::awaitable<void> run(F job)
+	{
+		if (pool == nullptr) {
+			job();
+			co_return;
+		}
+		const unsigned depth = ++queued;
+		unsigned peak = peakQueued;
+		while (depth > peak && !peakQueued.compare_exchange_weak(peak, depth))
+			;
+		co_await asio::co_spawn(pool->get_executor(), [this, &job]() -> asio::awaitable<void> {
+			queued--;
+			jobs++;
+			job();
+			co_return;
+		}, asio::use_awaitable);
 	}
 
-	void receive()
+	void logStats()
 	{
-		startTimer();
-		// TODO packet matcher, use DynamicBuffer?
-		asio::async_read(socket, asio::buffer(recvBuffer), asio::transfer_at_least(0x68),
-				std::bind(&AuthConnection::onReceive, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred));
+		const uint64_t count = jobs.exchange(0);
+		const unsigned peak = peakQueued.exchange(queued);
+		if (count != 0)
+			INFO_LOG(game, "auth crypto: %" PRIu64 " jobs, queue depth %u (peak %u)", count, queued.load(), peak);
 	}
 
 private:
-	AuthConnection(asio::io_context& io_context)
-		: socket(io_context), timer(io_context) {}
+	std::unique_ptr<asio::thread_pool> pool;
+	std::atomic<unsigned> queued { 0 };
+	std::atomic<unsigned> peakQueued { 0 };
+	std::atomic<uint64_t> jobs { 0 };
+};
 
-	void send()
-	{
-		asio::async_write(socket, asio::buffer(sendBuffer),
-			std::bind(&AuthConnection::onSent, shared_from_this(),
-					asio::placeholders::error,
-					asio::placeholders::bytes_transferred));
+class AuthSession : public TcpSession
+{
+public:
+	AuthSession(asio::io_context& io_context, CryptoPool& cryptoPool)
+		: TcpSession(io_context, Game::PropellerA, RECV_SIZE), cryptoPool(cryptoPool) {}
+
+private:
+	// Messages have no length field and the client waits for the reply before sending the next one
+	size_t frameSize(const uint8_t *data, size_t len) override {
+		return len >= MIN_RECV_SIZE ? std::min(len, RECV_SIZE) : 0;
 	}
-	void onSent(const std::error_code& ec, size_t len)
+
+	asio::awaitable<void> handleRequest(uint8_t *data, size_t len) override
 	{
-		if (ec) {
-			ERROR_LOG(game, "Send error: %s", ec.message().c_str());
-		}
-		else {
-			DEBUG_LOG(game, "sent %zd bytes", len);
-			receive();
+		uint32_t msg = read32(data, 0);
+		if (msg < 1 || msg > 4) {
+			ERROR_LOG(game, "auth: unhandled message %d", msg);
+			co_return;
 		}
+		co_await cryptoPool.run([this, msg, data, len]() {
+			handleMessage(msg, data, len);
+		});
+		write(sendBuffer.data(), sendBuffer.size());
 	}
 
 	void initBlowfish(const uint8_t *key) {
 		Blowfish_Init(&blowfishCtx, (uint8_t *)key, KEY_SIZE);
 	}
 
-	void encrypt(uint8_t *data, size_t len)
-	{
-		for (size_t i = 0; i < len; i += 8)
-		{
-			uint32_t l = read32(data, i);
-			uint32_t r = read32(data, i + 4);
-			Blowfish_Encrypt(&blowfishCtx, &l, &r);
-			write32(data, i, l);
-			write32(data, i + 4, r);
-		}
+	// A partial last block is processed as a full block
+	void encrypt(uint8_t *data, size_t len) {
+		Blowfish_EncryptECB(&blowfishCtx, data, (len + 7) & ~7);
 	}
 
-	void decrypt(uint8_t *data, size_t len)
-	{
-		for (size_t i = 0; i < len; i += 8)
-		{
-			uint32_t l = read32(data, i);
-			uint32_t r = read32(data, i + 4);
-			Blowfish_Decrypt(&blowfishCtx, &l, &r);
-			write32(data, i, l);
-			write32(data, i + 4, r);
-		}
+	void decrypt(uint8_t *data, size_t len) {
+		Blowfish_DecryptECB(&blowfishCtx, data, (len + 7) & ~7);
 	}
 
-	void onReceive(const std::error_code& ec, size_t len)
+	// Decrypt the message and prepare the encrypted reply. Called by the crypto pool.
+	void handleMessage(uint32_t msg, uint8_t *data, size_t len)
 	{
-		if (ec || len == 0)
-		{
-			if (ec && ec != asio::error::eof)
-				ERROR_LOG(game, "auth: %s", ec.message().c_str());
-			return;
-		}
-		if (len < 4) {
-			ERROR_LOG(game, "auth: small packet (%zd bytes)", len);
-			return;
-		}
-		uint32_t msg = read32(recvBuffer.data(), 0);
 		switch (msg)
 		{
 		case 1:
 			{
 				// Registration step 1
-				memcpy(key.data(), recvBuffer.data() + 4, key.size());
+				memcpy(key.data(), data + 4, key.size());
 				xor55(key.data(), key.size());
 				initBlowfish(key.data());
-				decrypt(recvBuffer.data() + 0x40, len - 0x40);
-				INFO_LOG(game, "auth: registration for %s", &recvBuffer[0x54]);
-				//dumpData(recvBuffer.data() + 0x40, len - 0x40);
+				decrypt(data + 0x40, len - 0x40);
+				INFO_LOG(game, "auth: registration for %s", &data[0x54]);
+				//dumpData(data + 0x40, len - 0x40);
 
 				// expect 0x38 bytes
 				// status 0 at offset 0
@@ -134,7 +146,6 @@ private:
 				// will respond with MSG3
 				sendBuffer.fill(0);
 				encrypt(sendBuffer.data(), sendBuffer.size());
-				send();
 				break;
 			}
 		case 3:
@@ -144,28 +155,27 @@ private:
 				key2 = key;
 				memset(key2.data(), 0, 16);
 				initBlowfish(key2.data());
-				decrypt(recvBuffer.data() + 0x40, len - 0x40);
+				decrypt(data + 0x40, len - 0x40);
 				DEBUG_LOG(game, "MSG3:");
-				//dumpData(recvBuffer.data() + 0x40, len - 0x40);
+				//dumpData(data + 0x40, len - 0x40);
 
 				// same reply as msg1
 				// user game id at offset 14
 				sendBuffer.fill(0);
 				// Use the player name as game id
-				strcpy((char *)&sendBuffer[0x14], (const char *)&recvBuffer[0x54]);
+				strcpy((char *)&sendBuffer[0x14], (const char *)&data[0x54]);
 				encrypt(sendBuffer.data(), sendBuffer.size());
-				send();
 				break;
 			}
 		case 2:
 			{
 				// Login step 1
-				memcpy(key.data(), recvBuffer.data() + 4, key.size());
+				memcpy(key.data(), data + 4, key.size());
 				xor55(key.data(), key.size());
 				initBlowfish(key.data());
-				decrypt(recvBuffer.data() + 0x40, len - 0x40);
-				INFO_LOG(game, "auth: login for game id %s, user name: %s", &recvBuffer[0x40], &recvBuffer[0x74]);
-				DEBUG_LOG(game, "Dricas game ID: %.16s", &recvBuffer[0x64]);
+				decrypt(data + 0x40, len - 0x40);
+				INFO_LOG(game, "auth: login for game id %s, user name: %s", &data[0x40], &data[0x74]);
+				DEBUG_LOG(game, "Dricas game ID: %.16s", &data[0x64]);
 
 				// expect 0x38 bytes
 				// status 0 at offset 0
@@ -173,7 +183,6 @@ private:
 				// will respond with MSG4
 				sendBuffer.fill(0);
 				encrypt(sendBuffer.data(), sendBuffer.size());
-				send();
 				break;
 			}
 		case 4:
@@ -183,70 +192,57 @@ private:
 				key2 = key;
 				memset(key2.data(), 0, 16);
 				initBlowfish(key2.data());
-				decrypt(recvBuffer.data() + 0x40, len - 0x40);
-				DEBUG_LOG(game, "MSG4: user name: %s", &recvBuffer[0x74]);
-				//dumpData(recvBuffer.data() + 0x40, len - 0x40);
+				decrypt(data + 0x40, len - 0x40);
+				DEBUG_LOG(game, "MSG4: user name: %s", &data[0x74]);
+				//dumpData(data + 0x40, len - 0x40);
 
 				sendBuffer.fill(0);
 				encrypt(sendBuffer.data(), sendBuffer.size());
-				send();
 				break;
 			}
-		default:
-			ERROR_LOG(game, "auth: unhandled message %d", msg);
-			receive();
 		}
 	}
 
-	void startTimer()
-	{
-		timer.expires_after(30s);
-		timer.async_wait([this](const std::error_code& ec) {
-			if (ec)
-				return;
-			std::error_code ignored;
-			socket.shutdown(asio::socket_base::shutdown_both, ignored);
-		});
-	}
-
 	static constexpr size_t KEY_SIZE = 56;
-	asio::ip::tcp::socket socket;
-	std::array<uint8_t, 0x90> recvBuffer;
+	static constexpr size_t MIN_RECV_SIZE = 0x68;
+	static constexpr size_t RECV_SIZE = 0x90;
 	std::array<uint8_t, 0x38> sendBuffer;
 	std::array<uint8_t, KEY_SIZE> key;
 	BLOWFISH_CTX blowfishCtx;
-	asio::steady_timer timer;
-
-	friend super;
+	CryptoPool& cryptoPool;
 };
 
 class AuthAcceptor
 {
 public:
-	AuthAcceptor(asio::io_context& io_context)
-		: io_context(io_context),
-		  acceptor(asio::ip::tcp::acceptor(io_context,
-				asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 20200)))
+	// cryptoThreads: number of threads running the auth encryption (0: run on the io_context)
+	AuthAcceptor(asio::io_context& io_context, unsigned cryptoThreads)
+		: cryptoPool(cryptoThreads),
+		  service(io_context, 20200, game, "auth", [&io_context, this]() {
+			  return std::make_unique<AuthSession>(io_context, cryptoPool);
+		  }),
+		  statsTimer(io_context)
 	{
-		asio::socket_base::reuse_address option(true);
-		acceptor.set_option(option);
+		onStatsTimer({});
 	}
 
-	void start()
-	{
-		AuthConnection::Ptr newConnection = AuthConnection::create(io_context);
-
-		acceptor.async_accept(newConnection->getSocket(),
-			[this, newConnection](const std::error_code& error) {
-				if (!error) {
-					INFO_LOG(game, "New connection from %s", newConnection->getSocket().remote_endpoint().address().to_string().c_str());
-					newConnection->receive();
-				}
-				start();
-			});
+	void start() {
+		service.start();
 	}
 
 private:
-	asio::io_context& io_context;
-	asio::ip::tcp::acceptor acceptor;
+	void onStatsTimer(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		cryptoPool.logStats();
+		statsTimer.expires_after(10min);
+		statsTimer.async_wait([this](const std::error_code& ec) {
+			onStatsTimer(ec);
+		});
+	}
+
+	CryptoPool cryptoPool;
+	TcpService service;
+	asio::steady_timer statsTimer;
 };
@@ -18,70 +18,95 @@
 */
 #pragma once
 #include "log.h"
-#include <dcserver/shared_this.hpp>
+#include "tcpsession.h"
 #include <dcserver/asio.hpp>
 #include <dcserver/database.hpp>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-class RankConnection : public SharedThis<RankConnection>
+class RankSession : public TcpSession
 {
 public:
-	asio::ip::tcp::socket& getSocket() {
-		return socket;
-	}
+	RankSession(asio::io_context& io_context, Database& database)
+		: TcpSession(io_context, Game::PropellerA, 1024), database(database) {}
 
-	void receive()
-	{
-		startTimer();
-		socket.async_read_some(asio::buffer(recvBuffer),
-				std::bind(&RankConnection::onReceive, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred));
+private:
+	size_t frameSize(const uint8_t *data, size_t len) override {
+		return len >= REQUEST_SIZE ? REQUEST_SIZE : 0;
 	}
+	asio::awaitable<void> handleRequest(uint8_t *data, size_t len) override;
 
-	void send(const std::vector<uint32_t>& data)
-	{
-		memcpy(&sendBuffer[sendIdx], data.data(), data.size() * sizeof(uint32_t));
-		sendIdx += data.size() * sizeof(uint32_t);
-		send();
-	}
+	// user name at offset 0x14, up to 32 bytes
+	static constexpr size_t REQUEST_SIZE = 0x34;
+	Database& database;
+};
 
-private:
-	RankConnection(asio::io_context& io_context, Database& database)
-		: socket(io_context), database(database), timer(io_context) {}
+// Writes the rank updates to the database on its own thread.
+// Updates of the same user are merged and written in batched transactions.
+class RankWriter
+{
+public:
+	RankWriter(const std::string& dbpath);
+	// Writes the pending updates before returning
+	~RankWriter();
 
-	void send()
-	{
-		if (sending)
-			return;
-		sending = true;
-		asio::async_write(socket, asio::buffer(sendBuffer, sendIdx),
-			std::bind(&RankConnection::onSent, shared_from_this(),
-					asio::placeholders::error,
-					asio::placeholders::bytes_transferred));
-	}
-	void onSent(const std::error_code& ec, size_t len)
+	struct Delta
 	{
-		if (ec)
-			ERROR_LOG(Game::PropellerA, "Send error: %s", ec.message().c_str());
-		else
-			DEBUG_LOG(Game::PropellerA, "sent %zd bytes", len);
-		sendIdx = 0;
-		sending = false;
-	}
+		int kills = 0;
+		int wins = 0;
+		int games = 0;
+		int flightTime = 0;
+		int flightDistance = 0;
+		int shotDown = 0;
+		int points = 0;
+
+		void add(const Delta& other);
+	};
+	// Can be called from any thread
+	void add(const std::string& name, const Delta& delta);
 
-	void onReceive(const std::error_code& ec, size_t len);
-	void startTimer();
+private:
+	using Clock = std::chrono::steady_clock;
+	struct Pending
+	{
+		Delta delta;
+		// when the oldest merged update was queued
+		Clock::time_point queued;
+	};
+	using Batch = std::unordered_map<std::string, Pending>;
 
-	asio::ip::tcp::socket socket;
-	std::array<uint8_t, 1024> recvBuffer;
-	std::array<uint8_t, 8500> sendBuffer;
-	size_t sendIdx = 0;
-	bool sending = false;
-	Database& database;
-	asio::steady_timer timer;
+	void run();
+	bool write(const Batch& batch);
+	void logStats();
 
-	friend super;
+	Database database;
+	std::mutex mutex;
+	std::condition_variable cond;
+	Batch pending;
+	bool stopping = false;
+	// Stats, protected by the mutex
+	uint64_t updates = 0;
+	uint64_t merged = 0;
+	// Stats of the writer thread
+	uint64_t rows = 0;
+	uint64_t batches = 0;
+	uint64_t failures = 0;
+	Clock::duration totalLatency {};
+	Clock::duration maxLatency {};
+	Clock::time_point lastStats;
+	std::thread thread;
+
+	// Time given to other updates to come in before writing a batch
+	static constexpr std::chrono::seconds FLUSH_DELAY { 2 };
+	static constexpr size_t MAX_BATCH = 256;
 };
 
 class RankAcceptor
@@ -93,27 +118,19 @@ public:
 		Instance = nullptr;
 	}
 
-	void start()
-	{
-		RankConnection::Ptr newConnection = RankConnection::create(io_context, database);
-
-		acceptor.async_accept(newConnection->getSocket(),
-			[this, newConnection](const std::error_code& error) {
-				if (!error) {
-					INFO_LOG(Game::PropellerA, "New connection from %s", newConnection->getSocket().remote_endpoint().address().to_string().c_str());
-					newConnection->receive();
-				}
-				start();
-			});
+	void start() {
+		service.start();
 	}
 
+	// Can be called from any thread. The database is updated by the rank writer thread.
 	void updateRank(const std::string& name, int kills, int wins, int games,
 			int flightTime, int flightDistance, int shotDown, int points);
 
-	static RankAcceptor *Instance;
+	// Read by the propeller arena server and its room workers
+	static std::atomic<RankAcceptor *> Instance;
 
 private:
-	asio::io_context& io_context;
-	asio::ip::tcp::acceptor acceptor;
 	Database database;
+	TcpService service;
+	std::unique_ptr<RankWriter> writer;
 };
@@ -19,12 +19,14 @@
 #include "propa_rank.h"
 #include "log.h"
 #include <algorithm>
+#include <cinttypes>
 #include <cmath>
 
 using namespace std::chrono_literals;
 
 PARoom::PARoom(Lobby& lobby, uint32_t id, const std::string& name, uint32_t attributes, Player *owner, asio::io_context& io_context)
-	: Room(lobby, id, name, attributes, owner, io_context), timer(io_context)
+	: Room(lobby, id, name, attributes, owner, io_context),
+	  timer(getTimerWheel(), [this]() { sendGameData(); })
 {
 	rngSeed = (uint32_t)time(nullptr);
 	srand(rngSeed);
@@ -48,14 +50,14 @@ bool PARoom::removePlayer(Player *player)
 
 	Packet packet;
 	sendPlayerList(packet);
-	Player::sendToAll(packet, players);
+	Player::sendToAll(packet, players, nullptr, SharedPacket::key(Packet::REQ_CHAT, OUT_PLAYER_LIST, getId()));
 
 	if (ownerLeft)
 	{
 		// Notify of new room master
 		Packet packet;
 		sendRoomAttrs(packet);
-		Player::sendToAll(packet, players);
+		Player::sendToAll(packet, players, nullptr, SharedPacket::key(Packet::REQ_CHAT, OUT_SET_ROOM_ATTRS, getId()));
 	}
 
 	return false;
@@ -178,7 +180,7 @@ void PARoom::setStateData(int slot, const uint8_t *data)
 	state.seqnum++;
 	if (!timerStarted) {
 		timerStarted = true;
-		sendGameData({});
+		sendGameData();
 	}
 }
 
@@ -188,7 +190,7 @@ void PARoom::setAudio(uint8_t slot, const uint8_t *data)
 		return;
 	if (data == nullptr)
 	{
-		if (Clock::now() - audioStart >= 500ms)
+		if (server.now() - audioStart >= 500ms)
 			// The talking player has 500 ms to start sending audio
 			talkingSlot = 0xff;
 		return;
@@ -211,12 +213,9 @@ void PARoom::setAudio(uint8_t slot, const uint8_t *data)
 	*/
 }
 
-void PARoom::sendGameData(const std::error_code& ec)
+void PARoom::sendGameData()
 {
-	if (ec)
-		return;
-
-	if (talkingSlot != 0xff && Clock::now() - audioStart >= 5s) {
+	if (talkingSlot != 0xff && server.now() - audioStart >= 5s) {
 		talkingSlot = 0xff;
 	}
 	else
@@ -229,7 +228,7 @@ void PARoom::sendGameData(const std::error_code& ec)
 				{
 					talkingSlot = slot;
 					audioSeq = 1;
-					audioStart = Clock::now();
+					audioStart = server.now();
 					DEBUG_LOG(game, "[%d] %s talking\n", slot, players[slot]->getName().c_str());
 					break;
 				}
@@ -251,6 +250,8 @@ void PARoom::sendGameData(const std::error_code& ec)
 	{
 		Packet packet;
 		packet.init(Packet::REQ_CHAT);
+		// large enough for both packet types
+		packet.reserve(0x104);
 		uint8_t *payload = &packet.data[packet.size];
 		if (talkingSlot != 0xff || slot >= 3 || missingData)
 		{
@@ -303,17 +304,18 @@ void PARoom::sendGameData(const std::error_code& ec)
 				memcpy(&payload[0x14 + idx * 0x3c], state.data.data(), state.data.size());
 			}
 		}
+		SharedPacket::Ptr shared = SharedPacket::create(packet);
 		for (unsigned i = 0; i < players.size(); i++)
 			if (playerState[i].seqnum > 0)
-				players[i]->send(packet);
+				players[i]->send(shared);
 	}
+	server.flush();
 
 	// The game seems to send a state every 4 frames
 	if (timer.expiry().time_since_epoch() != 0ms)
-		timer.expires_at(timer.expiry() + 133ms);	// 7.5/s
+		timer.expiresAt(timer.expiry() + 133ms);	// 7.5/s
 	else
-		timer.expires_after(133ms);
-	timer.async_wait(std::bind(&PARoom::sendGameData, this, asio::placeholders::error));
+		timer.expiresAfter(133ms);
 }
 
 void PARoom::setInGame(Player *player, bool inGame) {
@@ -323,8 +325,7 @@ void PARoom::setInGame(Player *player, bool inGame) {
 
 void PARoom::gameStop(Player *player)
 {
-	std::error_code ec;
-	timer.cancel(ec);
+	timer.cancel();
 	timerStarted = false;
 	startState = 0;
 
@@ -367,8 +368,9 @@ void PARoom::sendRankUpdate(Player *player, uint32_t flightTime, Packet& packet)
 			uint8_t bestScore = it->score;
 			if (state.score == bestScore)
 				state.wins++;
-			RankAcceptor::Instance->updateRank(player->getName(), state.kills, state.wins, 1,
-					flightTime / 30, std::round(state.flightDist), state.deaths, state.score);
+			if (RankAcceptor *rank = RankAcceptor::Instance.load())
+				rank->updateRank(player->getName(), state.kills, state.wins, 1,
+						flightTime / 30, std::round(state.flightDist), state.deaths, state.score);
 			state.rankUpdated = true;
 		}
 		packet.init(Packet::REQ_CHAT);
@@ -617,6 +619,7 @@ bool PropellerServer::handlePacket(Player *player, const uint8_t *data, size_t l
 
 			room->sendPlayerList(replyPacket);
 			room->sendPlayerList(relayPacket);
+			relayKey = SharedPacket::key(Packet::REQ_CHAT, OUT_PLAYER_LIST, room->getId());
 		}
 		break;
 
@@ -641,6 +644,7 @@ bool PropellerServer::handlePacket(Player *player, const uint8_t *data, size_t l
 			room->sendPlayerList(replyPacket);
 			player->ackPacket(replyPacket, data);
 			room->sendPlayerList(relayPacket);
+			relayKey = SharedPacket::key(Packet::REQ_CHAT, OUT_PLAYER_LIST, room->getId());
 			break;
 		}
 
@@ -664,6 +668,7 @@ bool PropellerServer::handlePacket(Player *player, const uint8_t *data, size_t l
 			room->sendRoomAttrs(replyPacket);
 			player->ackPacket(replyPacket, data);
 			room->sendRoomAttrs(relayPacket);
+			relayKey = SharedPacket::key(Packet::REQ_CHAT, OUT_SET_ROOM_ATTRS, room->getId());
 			break;
 		}
 
@@ -704,7 +709,8 @@ bool PropellerServer::handlePacket(Player *player, const uint8_t *data, size_t l
 		// 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 ................
 		// 00 00 00 00 00 a0 00 00 b3 e4 58 1b b3 e4 00 00 ..........X.....
 		// 00 00 00 00 ....
-		room->setStateData(data[0x11], data + 0x18);
+		if (player->isFreshGameData(data[0x11], data))
+			room->setStateData(data[0x11], data + 0x18);
 		break;
 
 	case IN_GAME_HDATA2: // in game data for human planes (with audio? doesn't look like it), len 6c
@@ -745,8 +751,11 @@ bool PropellerServer::handlePacket(Player *player, const uint8_t *data, size_t l
 		//0110   01 00 2c 16 6b 9f 74 dc 4d 04 f0 1a 53 fa 00 00   ..,.k.t.M...S...
 		//0120   00 00 00 00 ba 47 66 10                           .....Gf.
 
-		room->setStateData(data[0x11], data + 0x40);
-		room->setAudio(data[0x11], data + 0x16);
+		if (player->isFreshGameData(data[0x11], data))
+		{
+			room->setStateData(data[0x11], data + 0x40);
+			room->setAudio(data[0x11], data + 0x16);
+		}
 		break;
 
 	case IN_GAME_HDATA: // in game data for human planes
@@ -765,8 +774,11 @@ bool PropellerServer::handlePacket(Player *player, const uint8_t *data, size_t l
 		// 00 00 00 00 ....
 		// long (flag?)
 		// matches handle 1C/1D
-		room->setStateData(data[0x11], data + 0x18);
-		room->setAudio(data[0x11], nullptr);
+		if (player->isFreshGameData(data[0x11], data))
+		{
+			room->setStateData(data[0x11], data + 0x18);
+			room->setAudio(data[0x11], nullptr);
+		}
 		break;
 
 	case IN_GAME_ENDED: // Game ended, sent by all players
@@ -834,61 +846,39 @@ bool PropellerServer::handlePacket(Player *player, const uint8_t *data, size_t l
 //						p[14,+4*3c?]	plane pos data (same as C offset 30)
 //
 
-void RankConnection::onReceive(const std::error_code& ec, size_t len)
+asio::awaitable<void> RankSession::handleRequest(uint8_t *data, size_t len)
 {
-	if (ec || len == 0)
-	{
-		if (ec && ec != asio::error::eof)
-			ERROR_LOG(Game::PropellerA, "rank: %s", ec.message().c_str());
-		std::error_code ignored;
-		socket.shutdown(asio::socket_base::shutdown_both, ignored);
-		return;
+	std::string username((const char *)&data[0x14], strnlen((const char *)&data[0x14], REQUEST_SIZE - 0x14));
+	Statement stmt(database, "SELECT kills, wins, games, flightTime, flightDistance, shotDown, points, rank from ranking where user_id = ?");
+	stmt.bind(1, username);
+	// total kills, number of wins, number of games, total flight time, total flight distance,
+	// number of times shot down, total points, rank
+	// ranks: 0: none, 1:general, 2:lieutenant general, 3:major general, 4:colonel
+	// 		5:lieutenant colonel, 6:major, 7:captain, 8:first lieutenant, 9:second lieutenant,
+	// 		10:sergeant, 11:senior airman, 12:airman first class, 13:airman, 14:airman basic, 15:none...
+	// after game: 1st: 10 pts, 2nd: 5 pts, 3rd: 2 pts
+	std::array<uint32_t, 8> reply {};
+	if (!stmt.step()) {
+		reply[7] = ntohl(14);
 	}
-	if (len >= 0x34)
-	{
-		std::string username = (const char *)&recvBuffer[0x14];
-		Statement stmt(database, "SELECT kills, wins, games, flightTime, flightDistance, shotDown, points, rank from ranking where user_id = ?");
-		stmt.bind(1, username);
-		// total kills, number of wins, number of games, total flight time, total flight distance,
-		// number of times shot down, total points, rank
-		// ranks: 0: none, 1:general, 2:lieutenant general, 3:major general, 4:colonel
-		// 		5:lieutenant colonel, 6:major, 7:captain, 8:first lieutenant, 9:second lieutenant,
-		// 		10:sergeant, 11:senior airman, 12:airman first class, 13:airman, 14:airman basic, 15:none...
-		// after game: 1st: 10 pts, 2nd: 5 pts, 3rd: 2 pts
-		std::vector<uint32_t> data(8);
-		if (!stmt.step()) {
-			data[7] = ntohl(14);
-		}
-		else {
-			for (int i = 0; i < 8; i++)
-				data[i] = ntohl(stmt.getIntColumn(i));
-		}
-		send(data);
+	else {
+		for (int i = 0; i < 8; i++)
+			reply[i] = ntohl(stmt.getIntColumn(i));
 	}
-	receive();
+	write(reply.data(), sizeof(reply));
+	co_return;
 }
 
-void RankConnection::startTimer()
-{
-	timer.expires_after(30s);
-	timer.async_wait([this](const std::error_code& ec) {
-		if (ec)
-			return;
-		std::error_code ignored;
-		socket.shutdown(asio::socket_base::shutdown_both, ignored);
-	});
-}
-
-RankAcceptor *RankAcceptor::Instance;
+std::atomic<RankAcceptor *> RankAcceptor::Instance;
 
 RankAcceptor::RankAcceptor(asio::io_context& io_context, const std::string& dbpath)
-	: io_context(io_context),
-	  acceptor(asio::ip::tcp::acceptor(io_context,
-			asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 10100)))
+	: service(io_context, 10100, Game::PropellerA, "rank", [&io_context, this]() {
+		  return std::make_unique<RankSession>(io_context, database);
+	  })
 {
-	asio::socket_base::reuse_address option(true);
-	acceptor.set_option(option);
 	database.open(dbpath);
+	// Rank queries don't wait for the writer thread
+	Statement(database, "PRAGMA journal_mode=WAL").step();
 	Statement stmt(database, "SELECT name FROM sqlite_master WHERE type='table' AND name='ranking'");
 	if (!stmt.step()) {
 		WARN_LOG(Game::PropellerA, "Table 'ranking' doesn't exist. Creating it");
@@ -903,36 +893,181 @@ RankAcceptor::RankAcceptor(asio::io_context& io_context, const std::string& dbpa
 				"points INTEGER DEFAULT 0, "
 				"rank INTEGER DEFAULT 14)");
 	}
+	writer = std::make_unique<RankWriter>(dbpath);
 	Instance = this;
 }
 
 void RankAcceptor::updateRank(const std::string& name, int kills, int wins, int games,
 		int flightTime, int flightDistance, int shotDown, int points)
 {
-	Statement stmt(database, "UPDATE ranking SET kills = kills + ?, wins = wins + ?, games = games + ?,"
-			"flightTime = flightTime + ?, flightDistance = flightDistance + ?, shotDown = shotDown + ?, points = points + ?"
-			"WHERE user_id = ?");
-	stmt.bind(1, kills);
-	stmt.bind(2, wins);
-	stmt.bind(3, games);
-	stmt.bind(4, flightTime);
-	stmt.bind(5, flightDistance);
-	stmt.bind(6, shotDown);
-	stmt.bind(7, points);
-	stmt.bind(8, name);
-	stmt.step();
-	if (stmt.changedRows() == 0)
+	RankWriter::Delta delta;
+	delta.kills = kills;
+	delta.wins = wins;
+	delta.games = games;
+	delta.flightTime = flightTime;
+	delta.flightDistance = flightDistance;
+	delta.shotDown = shotDown;
+	delta.points = points;
+	writer->add(name, delta);
+}
+
+void RankWriter::Delta::add(const Delta& other)
+{
+	kills += other.kills;
+	wins += other.wins;
+	games += other.games;
+	flightTime += other.flightTime;
+	flightDistance += other.flightDistance;
+	shotDown += other.shotDown;
+	points += other.points;
+}
+
+RankWriter::RankWriter(const std::string& dbpath)
+{
+	database.open(dbpath);
+	// Safe with WAL: a power loss can only lose the last transactions
+	database.exec("PRAGMA synchronous=NORMAL");
+	lastStats = Clock::now();
+	thread = std::thread(&RankWriter::run, this);
+}
+
+RankWriter::~RankWriter()
+{
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		stopping = true;
+	}
+	cond.notify_one();
+	thread.join();
+	logStats();
+}
+
+void RankWriter::add(const std::string& name, const Delta& delta)
+{
+	std::lock_guard<std::mutex> _(mutex);
+	updates++;
+	auto it = pending.find(name);
+	if (it != pending.end())
+	{
+		it->second.delta.add(delta);
+		merged++;
+		return;
+	}
+	pending[name] = Pending{ delta, Clock::now() };
+	if (pending.size() >= MAX_BATCH)
+		cond.notify_one();
+}
+
+void RankWriter::run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		cond.wait(lock, [this]() { return stopping || !pending.empty(); });
+		if (!stopping)
+			cond.wait_for(lock, FLUSH_DELAY, [this]() { return stopping || pending.size() >= MAX_BATCH; });
+		if (pending.empty())
+			// stopping
+			break;
+		Batch batch;
+		batch.swap(pending);
+		lock.unlock();
+
+		const bool written = write(batch);
+
+		lock.lock();
+		if (!written && !stopping)
+		{
+			// Try again with the next batch
+			for (auto& [name, p] : batch)
+			{
+				auto it = pending.find(name);
+				if (it == pending.end()) {
+					pending.emplace(name, p);
+				}
+				else {
+					it->second.delta.add(p.delta);
+					it->second.queued = p.queued;
+				}
+			}
+		}
+		if (Clock::now() - lastStats >= std::chrono::minutes(10))
+		{
+			lock.unlock();
+			logStats();
+			lock.lock();
+		}
+	}
+}
+
+bool RankWriter::write(const Batch& batch)
+{
+	try {
+		database.exec("BEGIN");
+		Statement stmt(database, "INSERT INTO ranking (kills, wins, games, flightTime, flightDistance, shotDown, points, user_id) "
+				"VALUES (?, ?, ?, ?, ?, ?, ?, ?) "
+				"ON CONFLICT(user_id) DO UPDATE SET kills = kills + excluded.kills, wins = wins + excluded.wins, "
+				"games = games + excluded.games, flightTime = flightTime + excluded.flightTime, "
+				"flightDistance = flightDistance + excluded.flightDistance, shotDown = shotDown + excluded.shotDown, "
+				"points = points + excluded.points");
+		for (const auto& [name, p] : batch)
+		{
+			stmt.reset();
+			stmt.bind(1, p.delta.kills);
+			stmt.bind(2, p.delta.wins);
+			stmt.bind(3, p.delta.games);
+			stmt.bind(4, p.delta.flightTime);
+			stmt.bind(5, p.delta.flightDistance);
+			stmt.bind(6, p.delta.shotDown);
+			stmt.bind(7, p.delta.points);
+			stmt.bind(8, name);
+			stmt.step();
+		}
+		database.exec("COMMIT");
+	} catch (const std::exception& e) {
+		ERROR_LOG(Game::PropellerA, "Rank update of %zd users failed: %s", batch.size(), e.what());
+		try {
+			database.exec("ROLLBACK");
+		} catch (const std::exception&) {
+		}
+		failures++;
+		return false;
+	}
+	const Clock::time_point now = Clock::now();
+	for (const auto& [name, p] : batch)
+	{
+		totalLatency += now - p.queued;
+		maxLatency = std::max(maxLatency, now - p.queued);
+	}
+	rows += batch.size();
+	batches++;
+	DEBUG_LOG(Game::PropellerA, "Rank updates written for %zd users", batch.size());
+	return true;
+}
+
+// Called by the writer thread, or once it's stopped
+void RankWriter::logStats()
+{
+	uint64_t updates, merged;
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		updates = this->updates;
+		merged = this->merged;
+		this->updates = 0;
+		this->merged = 0;
+	}
+	if (updates != 0 || failures != 0)
 	{
-		Statement stmt(database, "INSERT INTO ranking (kills, wins, games, flightTime, flightDistance, shotDown, points, user_id)"
-				"VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
-		stmt.bind(1, kills);
-		stmt.bind(2, wins);
-		stmt.bind(3, games);
-		stmt.bind(4, flightTime);
-		stmt.bind(5, flightDistance);
-		stmt.bind(6, shotDown);
-		stmt.bind(7, points);
-		stmt.bind(8, name);
-		stmt.step();
+		using namespace std::chrono;
+		const long avgLatency = rows == 0 ? 0 : (long)duration_cast<milliseconds>(totalLatency).count() / (long)rows;
+		INFO_LOG(Game::PropellerA, "rank writer: %" PRIu64 " updates (%" PRIu64 " merged), %" PRIu64 " rows in %" PRIu64 " batches, "
+				"%" PRIu64 " failed, queue latency avg %ld ms max %ld ms", updates, merged, rows, batches, failures,
+				avgLatency, (long)duration_cast<milliseconds>(maxLatency).count());
 	}
+	rows = 0;
+	batches = 0;
+	failures = 0;
+	totalLatency = {};
+	maxLatency = {};
+	lastStats = Clock::now();
 }
@@ -86,7 +86,7 @@ public:
 	void resetState();
 
 private:
-	void sendGameData(const std::error_code& ec);
+	void sendGameData();
 	uint8_t controllingSlot(uint8_t slot) const {
 		return (slot + players.size()) % players.size();
 	}
@@ -100,7 +100,7 @@ private:
 	uint8_t startState = 0;
 	uint32_t rngSeed;
 	std::array<PlayerState, 6> playerState;
-	asio::steady_timer timer;
+	WheelTimer timer;
 	bool timerStarted = false;
 	uint8_t talkingSlot = 0xff;
 	uint8_t audioSeq = 1;
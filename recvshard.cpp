@@ -0,0 +1,87 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "recvshard.h"
+#include "log.h"
+
+#ifdef __linux__
+RecvShard::RecvShard(LobbyServer& server, uint16_t port)
+	: server(server),
+	  socket(server.getIoContext(), asio::ip::udp::v4()),
+	  buffers(Server::RECV_BATCH),
+	  msgs(Server::RECV_BATCH),
+	  iovecs(Server::RECV_BATCH),
+	  addrs(Server::RECV_BATCH)
+{
+	socket.set_option(Server::ReusePort(true));
+	socket.bind(asio::ip::udp::endpoint(asio::ip::udp::v4(), port));
+	for (unsigned i = 0; i < Server::RECV_BATCH; i++)
+	{
+		iovecs[i].iov_base = buffers[i].data();
+		iovecs[i].iov_len = buffers[i].size();
+		msghdr& hdr = msgs[i].msg_hdr;
+		hdr = {};
+		hdr.msg_name = &addrs[i];
+		hdr.msg_iov = &iovecs[i];
+		hdr.msg_iovlen = 1;
+	}
+	thread = std::thread(&RecvShard::run, this);
+}
+
+RecvShard::~RecvShard()
+{
+	stopping = true;
+	// wakes up the blocked recvmmsg
+	std::error_code ec;
+	socket.shutdown(asio::socket_base::shutdown_receive, ec);
+	if (thread.joinable())
+		thread.join();
+}
+
+void RecvShard::run()
+{
+	while (!stopping)
+	{
+		for (mmsghdr& msg : msgs)
+			msg.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		// Block until at least one datagram is available then get all the queued ones
+		int count = recvmmsg(socket.native_handle(), msgs.data(), msgs.size(), MSG_WAITFORONE, nullptr);
+		if (stopping)
+			break;
+		if (count < 0)
+		{
+			if (errno != EINTR && !stopping)
+				ERROR_LOG(server.game, "recvmmsg failed: errno %d", errno);
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> _(statsMutex);
+			stats.add(count);
+		}
+		for (int i = 0; i < count; i++)
+		{
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				ERROR_LOG(server.game, "datagram truncated: %d bytes", msgs[i].msg_len);
+				continue;
+			}
+			const sockaddr_in& addr = addrs[i];
+			asio::ip::udp::endpoint source(asio::ip::address_v4(ntohl(addr.sin_addr.s_addr)), ntohs(addr.sin_port));
+			server.forwardDatagram(buffers[i].data(), msgs[i].msg_len, source);
+		}
+	}
+}
+#endif
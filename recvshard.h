@@ -0,0 +1,59 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "model.h"
+#include <dcserver/asio.hpp>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+// Additional socket bound to the port of a lobby server with SO_REUSEPORT, read by its own thread.
+// The kernel selects the socket by hashing the source address and port, so all the datagrams of a player
+// are received by the same socket. They are handed over to the thread owning the player.
+class RecvShard
+{
+public:
+	RecvShard(LobbyServer& server, uint16_t port);
+	~RecvShard();
+
+	// Get and reset the receive stats of the shard
+	Server::RecvStats takeStats()
+	{
+		std::lock_guard<std::mutex> _(statsMutex);
+		Server::RecvStats s = stats;
+		stats = {};
+		return s;
+	}
+
+private:
+	void run();
+
+	LobbyServer& server;
+	asio::ip::udp::socket socket;
+	std::vector<Server::RecvBuffer> buffers;
+	std::vector<mmsghdr> msgs;
+	std::vector<iovec> iovecs;
+	std::vector<sockaddr_in> addrs;
+	std::atomic<bool> stopping { false };
+	std::mutex statsMutex;
+	Server::RecvStats stats;
+	std::thread thread;
+};
+#endif
@@ -0,0 +1,56 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "roomworker.h"
+#include "log.h"
+
+RoomWorker::RoomWorker(LobbyServer& server)
+	: server(server),
+	  work(asio::make_work_guard(io_context)),
+	  timerWheel(io_context),
+	  sendQueue(server, io_context)
+{
+	// Room timers run concurrently with the other workers but not with the server thread
+	timerWheel.setHandlerLock(server.getMutex(), true);
+	thread = std::thread(&RoomWorker::run, this);
+}
+
+RoomWorker::~RoomWorker() {
+	stop();
+}
+
+void RoomWorker::stop()
+{
+	work.reset();
+	io_context.stop();
+	if (thread.joinable())
+		thread.join();
+}
+
+void RoomWorker::run()
+{
+	currentWorker = this;
+	for (;;)
+	{
+		try {
+			io_context.run();
+			break;
+		} catch (const std::exception& e) {
+			ERROR_LOG(server.game, "Room worker: uncaught exception: %s", e.what());
+		}
+	}
+}
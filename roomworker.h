@@ -0,0 +1,74 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "model.h"
+#include "timerwheel.h"
+#include <dcserver/asio.hpp>
+#include <thread>
+
+// A thread running the game rooms assigned to it.
+// It has its own timer wheel and send queue, and handles the datagrams of the players in its rooms.
+class RoomWorker
+{
+public:
+	RoomWorker(LobbyServer& server);
+	~RoomWorker();
+	// Stop running the rooms and wait for the thread to exit
+	void stop();
+
+	LobbyServer& getServer() const {
+		return server;
+	}
+	asio::io_context& getIoContext() {
+		return io_context;
+	}
+	TimerWheel& getTimerWheel() {
+		return timerWheel;
+	}
+	Server::SendQueue& getSendQueue() {
+		return sendQueue;
+	}
+
+	unsigned getRoomCount() const {
+		return roomCount;
+	}
+	void addRoom() {
+		roomCount++;
+	}
+	void removeRoom() {
+		roomCount--;
+	}
+
+	// Worker running on the calling thread, or nullptr
+	static RoomWorker *current() {
+		return currentWorker;
+	}
+
+private:
+	void run();
+
+	LobbyServer& server;
+	asio::io_context io_context;
+	asio::executor_work_guard<asio::io_context::executor_type> work;
+	TimerWheel timerWheel;
+	Server::SendQueue sendQueue;
+	unsigned roomCount = 0;
+	std::thread thread;
+
+	static inline thread_local RoomWorker *currentWorker = nullptr;
+};
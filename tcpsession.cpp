@@ -0,0 +1,138 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "tcpsession.h"
+#include "log.h"
+#include <string.h>
+
+using namespace std::chrono_literals;
+
+TcpSession::TcpSession(asio::io_context& io_context, Game game, size_t maxRequestSize)
+	: socket(io_context), game(game), timer(io_context), recvBuffer(maxRequestSize)
+{
+}
+
+void TcpSession::write(const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	sendQueue.insert(sendQueue.end(), p, p + len);
+}
+
+void TcpSession::startTimer()
+{
+	timer.expires_after(30s);
+	timer.async_wait([this](const std::error_code& ec) {
+		if (ec)
+			return;
+		std::error_code ignored;
+		socket.shutdown(asio::socket_base::shutdown_both, ignored);
+	});
+}
+
+asio::awaitable<void> TcpSession::run()
+{
+	try {
+		for (;;)
+		{
+			startTimer();
+			recvSize += co_await socket.async_read_some(asio::buffer(&recvBuffer[recvSize], recvBuffer.size() - recvSize),
+					asio::use_awaitable);
+			// Handle all the complete requests received so far
+			size_t idx = 0;
+			while (idx < recvSize)
+			{
+				const size_t size = frameSize(&recvBuffer[idx], recvSize - idx);
+				if (size == 0)
+					break;
+				co_await handleRequest(&recvBuffer[idx], size);
+				idx += size;
+			}
+			recvSize -= idx;
+			memmove(&recvBuffer[0], &recvBuffer[idx], recvSize);
+			if (recvSize == recvBuffer.size()) {
+				ERROR_LOG(game, "Request too large from %s", socket.remote_endpoint().address().to_string().c_str());
+				break;
+			}
+			if (!sendQueue.empty())
+			{
+				DEBUG_LOG(game, "sending %zd bytes", sendQueue.size());
+				co_await asio::async_write(socket, asio::buffer(sendQueue), asio::use_awaitable);
+				sendQueue.clear();
+			}
+		}
+	} catch (const std::system_error& e) {
+		if (e.code() != asio::error::eof && e.code() != asio::error::operation_aborted)
+			ERROR_LOG(game, "Connection error: %s", e.what());
+	} catch (const std::exception& e) {
+		ERROR_LOG(game, "Connection error: %s", e.what());
+	}
+	timer.cancel();
+	std::error_code ignored;
+	socket.shutdown(asio::socket_base::shutdown_both, ignored);
+	socket.close(ignored);
+	recvSize = 0;
+	sendQueue.clear();
+}
+
+TcpService::TcpService(asio::io_context& io_context, uint16_t port, Game game, const char *name, SessionFactory factory)
+	: io_context(io_context),
+	  acceptor(asio::ip::tcp::acceptor(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))),
+	  game(game), name(name), factory(std::move(factory))
+{
+	asio::socket_base::reuse_address option(true);
+	acceptor.set_option(option);
+}
+
+void TcpService::start() {
+	asio::co_spawn(io_context, accept(), asio::detached);
+}
+
+asio::awaitable<void> TcpService::accept()
+{
+	std::unique_ptr<TcpSession> session;
+	for (;;)
+	{
+		if (session == nullptr)
+		{
+			if (freeSessions.empty()) {
+				session = factory();
+			}
+			else {
+				session = std::move(freeSessions.back());
+				freeSessions.pop_back();
+			}
+		}
+		try {
+			co_await acceptor.async_accept(session->getSocket(), asio::use_awaitable);
+		} catch (const std::exception& e) {
+			ERROR_LOG(game, "%s: accept failed: %s", name, e.what());
+			continue;
+		}
+		std::error_code ec;
+		const asio::ip::tcp::endpoint peer = session->getSocket().remote_endpoint(ec);
+		INFO_LOG(game, "%s: new connection from %s", name, peer.address().to_string().c_str());
+		asio::co_spawn(io_context, serve(std::move(session)), asio::detached);
+	}
+}
+
+asio::awaitable<void> TcpService::serve(std::unique_ptr<TcpSession> session)
+{
+	co_await session->run();
+	// Keep it for a future connection
+	if (freeSessions.size() < MAX_FREE_SESSIONS)
+		freeSessions.push_back(std::move(session));
+}
@@ -0,0 +1,85 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "kage.h"
+#include <dcserver/asio.hpp>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// A TCP connection handled by a coroutine.
+// Requests are extracted from the received stream with frameSize() and handled in order.
+// Several requests received together are all handled before their replies are sent in a single write.
+class TcpSession
+{
+public:
+	TcpSession(asio::io_context& io_context, Game game, size_t maxRequestSize);
+	virtual ~TcpSession() = default;
+
+	asio::ip::tcp::socket& getSocket() {
+		return socket;
+	}
+
+	// Handle the connection until it's closed, then reset the session so that it can be reused
+	asio::awaitable<void> run();
+
+protected:
+	// Size of the request at the beginning of data, or 0 if it isn't complete yet
+	virtual size_t frameSize(const uint8_t *data, size_t len) = 0;
+	// Handle a complete request. Replies are queued with write().
+	virtual asio::awaitable<void> handleRequest(uint8_t *data, size_t len) = 0;
+
+	// Queue data to be sent once the pending requests have been handled
+	void write(const void *data, size_t len);
+
+	asio::ip::tcp::socket socket;
+	const Game game;
+
+private:
+	void startTimer();
+
+	asio::steady_timer timer;
+	std::vector<uint8_t> recvBuffer;
+	size_t recvSize = 0;
+	std::vector<uint8_t> sendQueue;
+};
+
+// Accepts the connections of a TCP service.
+// Session objects and their buffers are reused for new connections.
+class TcpService
+{
+public:
+	using SessionFactory = std::function<std::unique_ptr<TcpSession>()>;
+
+	TcpService(asio::io_context& io_context, uint16_t port, Game game, const char *name, SessionFactory factory);
+
+	void start();
+
+private:
+	asio::awaitable<void> accept();
+	asio::awaitable<void> serve(std::unique_ptr<TcpSession> session);
+
+	asio::io_context& io_context;
+	asio::ip::tcp::acceptor acceptor;
+	const Game game;
+	const char * const name;
+	SessionFactory factory;
+	std::vector<std::unique_ptr<TcpSession>> freeSessions;
+	static constexpr size_t MAX_FREE_SESSIONS = 64;
+};
@@ -0,0 +1,222 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "timerwheel.h"
+
+void WheelTimer::expiresAt(time_point when)
+{
+	std::lock_guard<std::mutex> _(wheel.mutex);
+	if (pending())
+		wheel.unlink(this);
+	this->when = when;
+	wheel.schedule(this);
+}
+
+void WheelTimer::expiresAfter(Clock::duration duration) {
+	expiresAt(wheel.now() + duration);
+}
+
+void WheelTimer::cancel()
+{
+	std::lock_guard<std::mutex> _(wheel.mutex);
+	if (pending())
+		wheel.unlink(this);
+}
+
+// Index of the first bit set at or after from, or -1
+static int findNextBit(const uint64_t *words, unsigned bitCount, unsigned from)
+{
+	while (from < bitCount)
+	{
+		uint64_t w = words[from / 64] & (~0ull << (from % 64));
+		if (w != 0)
+			return (from & ~63u) + __builtin_ctzll(w);
+		from = (from & ~63u) + 64;
+	}
+	return -1;
+}
+
+TimerWheel::TimerWheel(asio::io_context& io_context)
+	: timer(io_context), start(Clock::now())
+{
+	updateTime();
+}
+
+uint64_t TimerWheel::toTick(time_point t) const
+{
+	if (t <= start)
+		return 0;
+	// round up so that timers never fire early
+	return std::chrono::ceil<std::chrono::milliseconds>(t - start).count();
+}
+
+void TimerWheel::schedule(WheelTimer *timer)
+{
+	if (count == 0 && !advancing)
+		// nothing to process until now
+		currentTick = std::max(currentTick, toTick(cachedNow));
+	timer->tick = std::max(toTick(timer->when), currentTick + 1);
+	place(timer);
+	count++;
+	arm();
+}
+
+void TimerWheel::place(WheelTimer *timer)
+{
+	const uint64_t tick = timer->tick;
+	uint16_t slot = OVERFLOW_SLOT;
+	for (unsigned level = 0; level < LEVELS; level++)
+	{
+		const unsigned shift = levelShift(level + 1);
+		if ((tick >> shift) == (currentTick >> shift))
+		{
+			// same block as the current tick at this level
+			const unsigned mask = level == 0 ? (1 << LEVEL0_BITS) - 1 : (1 << LEVEL_BITS) - 1;
+			slot = levelOffset(level) + ((tick >> levelShift(level)) & mask);
+			break;
+		}
+	}
+	timer->slot = slot;
+	timer->next = slots[slot];
+	if (timer->next != nullptr)
+		timer->next->pprev = &timer->next;
+	timer->pprev = &slots[slot];
+	slots[slot] = timer;
+	if (slot != OVERFLOW_SLOT)
+		bitmap[slot / 64] |= 1ull << (slot % 64);
+}
+
+void TimerWheel::unlink(WheelTimer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next != nullptr)
+		timer->next->pprev = timer->pprev;
+	timer->next = nullptr;
+	timer->pprev = nullptr;
+	if (timer->slot != OVERFLOW_SLOT && slots[timer->slot] == nullptr)
+		bitmap[timer->slot / 64] &= ~(1ull << (timer->slot % 64));
+	count--;
+}
+
+WheelTimer *TimerWheel::takeSlot(uint16_t slot)
+{
+	WheelTimer *list = slots[slot];
+	slots[slot] = nullptr;
+	if (slot != OVERFLOW_SLOT)
+		bitmap[slot / 64] &= ~(1ull << (slot % 64));
+	return list;
+}
+
+// Find the next tick at which timers must be run or moved to a lower level
+bool TimerWheel::nextWorkTick(uint64_t& tick) const
+{
+	if (count == 0)
+		return false;
+	for (unsigned level = 0; level < LEVELS; level++)
+	{
+		const unsigned bits = level == 0 ? LEVEL0_BITS : LEVEL_BITS;
+		const unsigned shift = levelShift(level);
+		const unsigned index = (currentTick >> shift) & ((1 << bits) - 1);
+		// Slots at this level only hold timers of the current block of the upper level
+		int next = findNextBit(&bitmap[levelOffset(level) / 64], 1 << bits, index + 1);
+		if (next >= 0)
+		{
+			const unsigned blockShift = levelShift(level + 1);
+			tick = ((currentTick >> blockShift) << blockShift) + ((uint64_t)next << shift);
+			return true;
+		}
+	}
+	// overflow list
+	const unsigned shift = levelShift(LEVELS);
+	tick = ((currentTick >> shift) + 1) << shift;
+	return true;
+}
+
+void TimerWheel::processTick(uint64_t tick, std::unique_lock<std::mutex>& lock)
+{
+	currentTick = tick;
+	// Move timers down from upper levels when entering their block
+	for (int level = LEVELS; level >= 1; level--)
+	{
+		const unsigned shift = levelShift(level);
+		if ((tick & ((1ull << shift) - 1)) != 0)
+			continue;
+		const uint16_t slot = level == LEVELS ? OVERFLOW_SLOT
+				: levelOffset(level) + ((tick >> shift) & ((1 << LEVEL_BITS) - 1));
+		WheelTimer *list = takeSlot(slot);
+		while (list != nullptr)
+		{
+			WheelTimer *timer = list;
+			list = timer->next;
+			place(timer);
+		}
+	}
+	// Run expired timers
+	const uint16_t slot = tick & ((1 << LEVEL0_BITS) - 1);
+	while (slots[slot] != nullptr)
+	{
+		WheelTimer *timer = slots[slot];
+		unlink(timer);
+		// the handler may delete or reschedule the timer
+		lock.unlock();
+		timer->handler();
+		lock.lock();
+	}
+}
+
+void TimerWheel::advance(uint64_t target, std::unique_lock<std::mutex>& lock)
+{
+	advancing = true;
+	uint64_t tick;
+	while (nextWorkTick(tick) && tick <= target)
+		processTick(tick, lock);
+	currentTick = std::max(currentTick, target);
+	advancing = false;
+}
+
+void TimerWheel::arm()
+{
+	uint64_t tick;
+	if (!nextWorkTick(tick) || tick == armedTick)
+		return;
+	armedTick = tick;
+	timer.expires_at(start + std::chrono::milliseconds(tick));
+	timer.async_wait([this](const std::error_code& ec) {
+		onTimer(ec);
+	});
+}
+
+void TimerWheel::onTimer(const std::error_code& ec)
+{
+	if (ec)
+		return;
+	std::shared_lock<std::shared_mutex> sharedLock;
+	std::unique_lock<std::shared_mutex> exclusiveLock;
+	if (handlerMutex != nullptr)
+	{
+		if (sharedHandlerLock)
+			sharedLock = std::shared_lock<std::shared_mutex>(*handlerMutex);
+		else
+			exclusiveLock = std::unique_lock<std::shared_mutex>(*handlerMutex);
+	}
+	updateTime();
+	std::unique_lock<std::mutex> lock(mutex);
+	armedTick = UINT64_MAX;
+	// round down so that timers due later in the current millisecond don't fire early
+	advance(std::chrono::floor<std::chrono::milliseconds>(cachedNow - start).count(), lock);
+	arm();
+}
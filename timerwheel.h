@@ -0,0 +1,135 @@
+/*
+	Kage game server.
+    Copyright 2025 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <dcserver/asio.hpp>
+#include <stdint.h>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+
+using Clock = std::chrono::steady_clock;
+using time_point = std::chrono::time_point<Clock>;
+
+class TimerWheel;
+
+// A timer driven by a TimerWheel. The handler is called from the wheel's io_context.
+// The timer can be rescheduled or deleted from its own handler, and scheduled from any thread.
+class WheelTimer
+{
+public:
+	WheelTimer(TimerWheel& wheel, std::function<void()> handler)
+		: wheel(wheel), handler(std::move(handler)) {
+	}
+	WheelTimer(const WheelTimer&) = delete;
+	WheelTimer& operator=(const WheelTimer&) = delete;
+	~WheelTimer() {
+		cancel();
+	}
+
+	void expiresAt(time_point when);
+	void expiresAfter(Clock::duration duration);
+	void cancel();
+
+	bool pending() const {
+		return pprev != nullptr;
+	}
+	time_point expiry() const {
+		return when;
+	}
+
+private:
+	TimerWheel& wheel;
+	std::function<void()> handler;
+	time_point when;
+	uint64_t tick = 0;
+	// intrusive slot list
+	WheelTimer *next = nullptr;
+	WheelTimer **pprev = nullptr;
+	uint16_t slot = 0;
+
+	friend class TimerWheel;
+};
+
+// Hierarchical timing wheel with 1 ms ticks.
+// Level 0 has 256 slots of 1 ms, levels 1 to 3 have 64 slots each covering 256 ms, 16.4 s and 17.5 min.
+// Timers further away go into an overflow list.
+// All the timers of a wheel share a single asio timer armed on the next slot to process.
+class TimerWheel
+{
+public:
+	TimerWheel(asio::io_context& io_context);
+
+	// Time cached at the beginning of the current event handler of the calling thread
+	time_point now() const {
+		return cachedNow;
+	}
+	// Must be called at the beginning of each event handler
+	void updateTime() {
+		cachedNow = Clock::now();
+	}
+
+	// Lock held while running the timer handlers, shared or exclusive
+	void setHandlerLock(std::shared_mutex& mutex, bool shared) {
+		handlerMutex = &mutex;
+		sharedHandlerLock = shared;
+	}
+
+private:
+	static constexpr unsigned LEVEL0_BITS = 8;
+	static constexpr unsigned LEVEL_BITS = 6;
+	static constexpr unsigned LEVELS = 4;
+	static constexpr unsigned SLOT_COUNT = (1 << LEVEL0_BITS) + (LEVELS - 1) * (1 << LEVEL_BITS);
+	static constexpr uint16_t OVERFLOW_SLOT = SLOT_COUNT;
+
+	static constexpr unsigned levelShift(unsigned level) {
+		return level == 0 ? 0 : LEVEL0_BITS + (level - 1) * LEVEL_BITS;
+	}
+	static constexpr unsigned levelOffset(unsigned level) {
+		return level == 0 ? 0 : (1 << LEVEL0_BITS) + (level - 1) * (1 << LEVEL_BITS);
+	}
+
+	uint64_t toTick(time_point t) const;
+	void schedule(WheelTimer *timer);
+	void place(WheelTimer *timer);
+	void unlink(WheelTimer *timer);
+	WheelTimer *takeSlot(uint16_t slot);
+	bool nextWorkTick(uint64_t& tick) const;
+	void processTick(uint64_t tick, std::unique_lock<std::mutex>& lock);
+	void advance(uint64_t target, std::unique_lock<std::mutex>& lock);
+	void arm();
+	void onTimer(const std::error_code& ec);
+
+	asio::steady_timer timer;
+	const time_point start;
+	static inline thread_local time_point cachedNow;
+	// Protects the wheel and the asio timer. Released while running handlers.
+	std::mutex mutex;
+	std::shared_mutex *handlerMutex = nullptr;
+	bool sharedHandlerLock = false;
+	bool advancing = false;
+	uint64_t currentTick = 0;
+	uint64_t armedTick = UINT64_MAX;
+	size_t count = 0;
+	std::array<WheelTimer *, SLOT_COUNT + 1> slots {};
+	// one bit per non-empty slot, overflow excluded
+	std::array<uint64_t, SLOT_COUNT / 64> bitmap {};
+
+	friend class WheelTimer;
+};